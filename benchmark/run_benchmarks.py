@@ -16,11 +16,13 @@ params = {'text.usetex' : True,
 plt.rcParams.update(params)
 
 JEMALLOC_PATH = "/usr/lib/libjemalloc.so"
-BENCHMARKS = ["alloc_free", "alloc_free_alloc", "fastalloc", "linkedlist"]
+BENCHMARKS = ["alloc_free", "alloc_free_alloc", "fastalloc", "linkedlist", "reserve_n", "handle_lookup"]
 BENCHTITLES = {"alloc_free": "Allocate and Free",
                "alloc_free_alloc": "Allocate, Free and Allocate",
                "fastalloc": "Allocation Loop",
                "linkedlist": "Linked List Creation",
+               "reserve_n": "Batched Reservation",
+               "handle_lookup": "Object Lookup by Handle",
                "recovery": "nvm\_malloc Internal Recovery"}
 
 def getCacheFileName(binary, args, with_jemalloc):
@@ -135,6 +137,8 @@ if __name__ == "__main__":
     parser.add_argument("--run-alloc-free-alloc", action="store_true")
     parser.add_argument("--run-fastalloc", action="store_true")
     parser.add_argument("--run-linkedlist", action="store_true")
+    parser.add_argument("--run-reserve-n", action="store_true")
+    parser.add_argument("--run-handle-lookup", action="store_true")
     parser.add_argument("--run-recovery", action="store_true")
     parser.add_argument("--threads-min", type=int, default=1)
     parser.add_argument("--threads-max", type=int, default=10)
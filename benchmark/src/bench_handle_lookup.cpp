@@ -0,0 +1,85 @@
+#include "common.h"
+
+#include <cstring>
+#include <sstream>
+
+#define NUM_IDS 1000
+#define NUM_LOOKUPS 1000000
+#define ID_LENGTH 128
+
+std::vector<uint64_t> workerTimes;
+uint64_t object_size_min = 64;
+uint64_t object_size_max = 64;
+int lookup_by_id = 0;
+
+void worker(int id) {
+    std::vector<std::string> ids;
+    std::vector<nvb::id_handle_t> handles;
+    nvb::timer timer;
+    std::default_random_engine generator;
+    std::uniform_int_distribution<uint64_t> distribution(object_size_min, object_size_max);
+    auto randomSize = std::bind(distribution, generator);
+    void * volatile object = nullptr;
+
+    // create the IDs, padded to a fixed length so that every lookup hashes and compares the same amount
+    for (int i=0; i<NUM_IDS; ++i) {
+        std::stringstream ss;
+        ss << "thread" << id << "_object" << i << "_";
+        std::string objectId = ss.str();
+        objectId.resize(ID_LENGTH, 'x');
+        void *ptr = nvb::reserve_id(objectId, randomSize());
+        memset(ptr, 5, 64);
+        nvb::persist(ptr, 64);
+        nvb::activate_id(objectId);
+        ids.push_back(objectId);
+        handles.push_back(nvb::open_id(objectId));
+    }
+
+    // run the benchmark
+    timer.start();
+    for (int i=0; i<NUM_LOOKUPS; ++i) {
+        if (lookup_by_id)
+            object = nvb::get_id(ids[i % NUM_IDS]);
+        else
+            object = nvb::id_get(handles[i % NUM_IDS]);
+    }
+    (void) object;
+
+    // save result
+    workerTimes[id] = timer.stop();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        std::cout << "usage: " << argv[0] << " <num_threads> <object_size_min> [object_size_max] [lookup_by_id]" << std::endl;
+        return -1;
+    }
+    size_t n_threads = atoi(argv[1]);
+    object_size_min = atoi(argv[2]);
+    if (object_size_min < 64) {
+        std::cout << "WARNING: specified min object size was less than minimum, using 64 bytes instead" << std::endl;
+        object_size_min = 64;
+    }
+    if (argc >= 4) {
+        object_size_max = atoi(argv[3]);
+        if (object_size_max < object_size_min) {
+            std::cout << "WARNING: max object size was less than min, using min instead" << std::endl;
+            object_size_max = object_size_min;
+        }
+    } else {
+        object_size_max = object_size_min;
+    }
+    // a nonzero fourth argument looks the objects up by their ID string for comparison
+    if (argc == 5) {
+        lookup_by_id = atoi(argv[4]) != 0;
+    }
+    workerTimes.resize(n_threads, 0);
+    nvb::initialize("/mnt/pmfs/nvb", 0);
+    nvb::execute_in_pool(worker, n_threads);
+    uint64_t avg = 0;
+    for (auto t : workerTimes)
+        avg += t;
+    avg /= n_threads;
+    std::cout << avg << std::endl;
+    return 0;
+}
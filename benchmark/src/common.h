@@ -31,6 +31,10 @@ struct StringHashCompare {
 };
 typedef tbb::concurrent_hash_map<std::string, void*, StringHashCompare> object_table_t;
 extern object_table_t _object_table;
+// a handle is the table's value slot, which stays in place until the ID is erased
+typedef void** id_handle_t;
+#elif USE_NVM_MALLOC
+typedef nvm_id_t id_handle_t;
 #endif
 
 inline void* initialize(const std::string workspace_path, int recover_if_possible) {
@@ -49,6 +53,16 @@ inline void* reserve(uint64_t n_bytes) {
 #endif
 }
 
+inline uint64_t reserve_n(uint64_t n_bytes, uint64_t count, void **out) {
+#ifdef USE_MALLOC
+    uint64_t i;
+    for (i=0; i<count && (out[i] = malloc(n_bytes)) != nullptr; ++i);
+    return i;
+#elif USE_NVM_MALLOC
+    return nvm_reserve_n(n_bytes, count, out);
+#endif
+}
+
 inline void* reserve_id(const std::string id, uint64_t n_bytes) {
 #ifdef USE_MALLOC
     void *ptr = malloc(n_bytes);
@@ -90,6 +104,25 @@ inline void* get_id(const std::string id) {
 #endif
 }
 
+inline id_handle_t open_id(const std::string id) {
+#ifdef USE_MALLOC
+    object_table_t::accessor acc;
+    if (!_object_table.find(acc, id))
+        return nullptr;
+    return &acc->second;
+#elif USE_NVM_MALLOC
+    return nvm_id_open(id.c_str());
+#endif
+}
+
+inline void* id_get(id_handle_t handle) {
+#ifdef USE_MALLOC
+    return *handle;
+#elif USE_NVM_MALLOC
+    return nvm_id_get(handle);
+#endif
+}
+
 inline void free(void *ptr, void **link_ptr1=nullptr, void *target1=nullptr, void **link_ptr2=nullptr, void *target2=nullptr) {
 #ifdef USE_MALLOC
     ::free(ptr);
@@ -8,6 +8,10 @@
 #include <sys/mman.h>
 
 #include "chunk.h"
+#include "free_index.h"
+#include "recovery.h"
+#include "slab.h"
+#include "tcache.h"
 #include "util.h"
 
 #define NVM_ABS_TO_REL(base, ptr) ((uintptr_t)ptr - (uintptr_t)base)
@@ -17,39 +21,129 @@ extern void *nvm_start;
 extern arena_t **arenas;
 extern uint64_t current_version;
 
-arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t n_bytes);
+arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t binind);
 nvm_block_header_t* arena_create_block(arena_t *arena, uint32_t n_pages);
 arena_block_t* arena_add_chunk(arena_t *arena);
 
-/* comparison function for a bin's run tree - sort by address on NVM */
-int run_node_compare(const void *_a, const void *_b) {
-    const arena_run_t *a = tree_entry(_a, arena_run_t, link);
-    const arena_run_t *b = tree_entry(_b, arena_run_t, link);
-    return generic_compare((uintptr_t)a->nvm_run, (uintptr_t)b->nvm_run);
+/* run geometry per size class and size to class lookup in 64 byte steps, computed once */
+static arena_run_geometry_t run_geometry[NUM_ARENA_BINS];
+static uint8_t size_to_bin[SCLASS_SMALL_MAX/CACHE_LINE_SIZE + 1];
+static pthread_once_t run_geometry_once = PTHREAD_ONCE_INIT;
+
+static uint32_t arena_class_size(uint32_t binind) {
+    /* packed [16, 32, 48], then [64, 128, ..., 512], then four classes per doubling [640, 768, 896, 1024, 1280, ..., 16384] */
+    uint32_t group_size;
+    if (binind < NUM_PACKED_BINS) {
+        return (binind + 1) * 16;
+    }
+    binind -= NUM_PACKED_BINS;
+    if (binind < 8) {
+        return (binind + 1) * 64;
+    }
+    group_size = 512 << ((binind - 8) / 4);
+    return group_size + (group_size / 4) * ((binind - 8) % 4 + 1);
 }
 
-/* comparison function for free pageruns - sort by size */
-int block_node_compare(const void *_a, const void *_b) {
-    const arena_block_t *a = tree_entry(_a, arena_block_t, link);
-    const arena_block_t *b = tree_entry(_b, arena_block_t, link);
-    return generic_compare(a->n_pages, b->n_pages);
+static void arena_run_layout(uint32_t elem_size, uint32_t n_pages, uint32_t *n_slots, uint32_t *hdr_lines) {
+    *hdr_lines = 1;
+    *n_slots = (n_pages*BLOCK_SIZE - CACHE_LINE_SIZE) / elem_size;
+    if (*n_slots > 64) {
+        /* bitmap needs an extension line behind the header */
+        *hdr_lines = 2;
+        *n_slots = (n_pages*BLOCK_SIZE - 2*CACHE_LINE_SIZE) / elem_size;
+    }
+    if (*n_slots > RUN_MAX_SLOTS) {
+        *n_slots = RUN_MAX_SLOTS;
+    }
 }
 
-static arena_block_t* tree_upper_bound(uint32_t req_pages, struct tree_root *root) {
-    arena_block_t *entry;
-    arena_block_t *last_larger = NULL;
-    while (root) {
-        entry = tree_entry(root, arena_block_t, link);
-        if (entry->n_pages == req_pages) {
-            return entry;
-        } else if (entry->n_pages < req_pages){
-            root = root->right;
-        } else {
-            last_larger = entry;
-            root = root->left;
+static void arena_init_run_geometry() {
+    uint32_t i, j, n_pages, n_slots, hdr_lines, waste, best_waste;
+    arena_run_geometry_t *geometry = NULL;
+
+    for (i=0, j=0; i<NUM_ARENA_BINS; ++i) {
+        geometry = &run_geometry[i];
+        geometry->elem_size = arena_class_size(i);
+        geometry->n_pages = 0;
+        best_waste = ~0u;
+
+        /* grow the run page by page until it holds enough slots to amortize header and arena lock
+           and the tail behind the last slot is small, otherwise settle for the least waste */
+        for (n_pages=1; n_pages<=RUN_MAX_PAGES; ++n_pages) {
+            arena_run_layout(geometry->elem_size, n_pages, &n_slots, &hdr_lines);
+            waste = n_pages*BLOCK_SIZE - n_slots*geometry->elem_size;
+            if (n_slots == 0) {
+                continue;
+            }
+            /* compare waste relative to run size */
+            if (geometry->n_pages == 0 || (uint64_t)waste * geometry->n_pages < (uint64_t)best_waste * n_pages) {
+                geometry->n_pages = n_pages;
+                best_waste = waste;
+            }
+            if (n_slots >= RUN_MIN_SLOTS && waste * RUN_MAX_WASTE <= n_pages*BLOCK_SIZE) {
+                geometry->n_pages = n_pages;
+                break;
+            }
+        }
+        arena_run_layout(geometry->elem_size, geometry->n_pages, &n_slots, &hdr_lines);
+        geometry->n_slots = n_slots;
+        geometry->hdr_lines = hdr_lines;
+
+        /* every request up to this class's size maps to it, packed classes are resolved without the table */
+        for (; i >= NUM_PACKED_BINS && j <= geometry->elem_size / CACHE_LINE_SIZE; ++j) {
+            size_to_bin[j] = i;
         }
     }
-    return last_larger;
+}
+
+/* smallest free block with at least req_pages pages, lowest address first, arena lock must be held */
+static arena_block_t* arena_best_fit(arena_t *arena, uint32_t req_pages) {
+    free_index_node_t *node = free_index_best_fit(&arena->free_pageruns, req_pages);
+    return node ? free_index_entry(node, arena_block_t, link) : NULL;
+}
+
+static inline nvm_page_map_t* arena_page_map(void *ptr) {
+    return (nvm_page_map_t*) ((((uintptr_t)ptr - (uintptr_t)nvm_start) & ~(CHUNK_SIZE-1)) + (uintptr_t)nvm_start + BLOCK_SIZE);
+}
+
+static inline uint32_t arena_page_index(void *ptr) {
+    return (((uintptr_t)ptr - (uintptr_t)nvm_start) % CHUNK_SIZE) / BLOCK_SIZE;
+}
+
+/* check whether a block header belongs to a block currently listed in the arena's free pageruns, arena lock must be held */
+static inline int arena_block_listed(arena_t *arena, nvm_block_header_t *nvm_block) {
+    return nvm_block->state == (USAGE_FREE | STATE_INITIALIZED) &&
+           nvm_block->version == current_version &&
+           nvm_block->vdata != NULL &&
+           nvm_block->arena_id == arena->id;
+}
+
+/* insert a free block into the arena's free pageruns and tag its last page, arena lock must be held */
+static void arena_list_block(arena_t *arena, arena_block_t *block) {
+    nvm_block_header_t *nvm_block = block->nvm_block;
+    uint32_t page_idx = arena_page_index(nvm_block);
+
+    nvm_block->vdata = block;
+    nvm_block->version = current_version;
+    arena_page_map(nvm_block)->free_head[page_idx + block->n_pages - 1] = page_idx;
+    free_index_insert(&arena->free_pageruns, &block->link, block->n_pages, (uintptr_t)nvm_block);
+}
+
+/* mark a block carved from a free block in the page map, the pages inside may still carry marks of blocks merged
+   into the free one. this must be persistent before the free block shrinks, scans would skip the new block otherwise */
+static void arena_map_block_pages(nvm_block_header_t *nvm_block, uint32_t n_pages) {
+    nvm_page_map_t *page_map = arena_page_map(nvm_block);
+    uint32_t page_idx = arena_page_index(nvm_block);
+
+    page_map->page_info[page_idx] = PAGE_INFO(USAGE_FREE, 0);
+    memset(&page_map->page_info[page_idx + 1], 0, n_pages - 1);
+    PERSIST_RANGE(&page_map->page_info[page_idx], n_pages);
+}
+
+/* remove a free block from the arena's free pageruns, arena lock must be held */
+static void arena_unlist_block(arena_t *arena, arena_block_t *block) {
+    free_index_remove(&arena->free_pageruns, &block->link);
+    block->nvm_block->vdata = NULL;
 }
 
 void arena_init(arena_t *arena, uint32_t id, nvm_chunk_header_t *first_chunk, int create_initial_block) {
@@ -57,14 +151,20 @@ void arena_init(arena_t *arena, uint32_t id, nvm_chunk_header_t *first_chunk, in
     arena_block_t *node;
     nvm_block_header_t *nvm_block;
 
+    pthread_once(&run_geometry_once, arena_init_run_geometry);
+
     arena->id = id;
-    arena->free_pageruns = NULL;
+    arena->n_threads = 0;
+    arena->log_next = 0;
+    pthread_mutex_init(&arena->epoch_mtx, NULL);
+    free_index_init(&arena->free_pageruns);
+    slab_init(&arena->block_cache, sizeof(arena_block_t));
+    slab_init(&arena->run_cache, sizeof(arena_run_t));
     pthread_mutex_init(&arena->mtx, NULL);
 
-    /* initialize bins for small classes [64, 128, 192, ..., 1984] */
-    for (i=0; i<31; ++i) {
+    /* initialize bins for small classes [16, 32, 48, 64, 128, ..., 512, 640, 768, ..., 16384] */
+    for (i=0; i<NUM_ARENA_BINS; ++i) {
         arena->bins[i].current_run = NULL;
-        arena->bins[i].n_free = 0;
         arena->bins[i].n_runs = 0;
         arena->bins[i].runs = NULL;
         pthread_mutex_init(&arena->bins[i].mtx, NULL);
@@ -72,25 +172,29 @@ void arena_init(arena_t *arena, uint32_t id, nvm_chunk_header_t *first_chunk, in
 
     if (create_initial_block) {
         /* initialize tree for free blocks and insert initial free block */
-        node = (arena_block_t*) malloc(sizeof(arena_block_t));
-        node->nvm_block = nvm_block = (nvm_block_header_t*) (first_chunk+1);
-        node->n_pages = CHUNK_SIZE / BLOCK_SIZE - 1;
+        node = (arena_block_t*) slab_alloc(&arena->block_cache);
+        node->nvm_block = nvm_block = (nvm_block_header_t*) ((uintptr_t)first_chunk + ARENA_FIRST_PAGE*BLOCK_SIZE);
+        node->n_pages = CHUNK_PAGES - ARENA_FIRST_PAGE;
         node->arena = arena;
-        tree_add(&node->link, block_node_compare, &arena->free_pageruns);
 
         // TODO: this is not fully failure atomic...
         nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
-        nvm_block->n_pages = CHUNK_SIZE / BLOCK_SIZE - 1;
+        nvm_block->n_pages = CHUNK_PAGES - ARENA_FIRST_PAGE;
         nvm_block->arena_id = arena->id;
         PERSIST(nvm_block);
+        arena_list_block(arena, node);
+    }
+}
+
+uint32_t arena_size_class(uint32_t n_bytes) {
+    assert(n_bytes <= SCLASS_SMALL_MAX);
+    if (n_bytes <= SCLASS_PACKED_MAX) {
+        return n_bytes ? (n_bytes + 15) / 16 - 1 : 0;
     }
+    return size_to_bin[(n_bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE];
 }
 
 void* arena_allocate(arena_t *arena, uint32_t n_bytes) {
-    int i;
-    char mask;
-    arena_bin_t *bin = NULL;
-    arena_run_t *run = NULL;
     nvm_block_header_t *nvm_block = NULL;
     void *result = NULL;
 
@@ -98,74 +202,178 @@ void* arena_allocate(arena_t *arena, uint32_t n_bytes) {
 
     /* check whether this is a small or large request */
     if (n_bytes <= SCLASS_SMALL_MAX) {
-        /* small request, round up to the nearest multiple of 64 */
-        n_bytes = (n_bytes & ~63) + (n_bytes % 64 != 0 ? 64 : 0);
-        bin = &arena->bins[n_bytes / 64 - 1];
+        /* small request, take a single slot from the bin */
+        if (arena_fill(arena, arena_size_class(n_bytes), &result, 1) == 0) {
+            return NULL;
+        }
+    } else {
+        /* large request, round up to the nearest multiple of BLOCK_SIZE including the header */
+        n_bytes += sizeof(nvm_block_header_t);
+        n_bytes = (n_bytes & ~4095) + (n_bytes % BLOCK_SIZE != 0 ? BLOCK_SIZE : 0);
+        if ((nvm_block = arena_create_block(arena, n_bytes/BLOCK_SIZE)) == NULL) {
+            return NULL;
+        }
+        result = (void*) (nvm_block + 1);
+    }
 
-        pthread_mutex_lock(&bin->mtx);
+    return result;
+}
 
-        if (bin->n_free == 0) {
-            /* no more space in bin, allocate new run */
-            if ((run = arena_create_run(arena, bin, n_bytes)) == NULL) {
-                pthread_mutex_unlock(&bin->mtx);
-                return NULL;
+/* claim a free slot of the run without holding the bin lock, returns -1 if the run is full */
+static inline int arena_run_claim(arena_run_t *run) {
+    uint32_t n_free, w;
+    uint64_t bitmap, bit;
+    int idx;
+
+    /* reserve a slot first, which guarantees a clear bit until we find it */
+    do {
+        if ((n_free = run->n_free) == 0) {
+            return -1;
+        }
+    } while (!__sync_bool_compare_and_swap(&run->n_free, n_free, n_free - 1));
+
+    for (w=0; ; w = (w + 1) % run->n_words) {
+        while ((bitmap = run->bitmap[w]) != ~0ul) {
+            idx = __builtin_ctzll(~bitmap);
+            bit = 1ul << idx;
+            if ((__sync_fetch_and_or(&run->bitmap[w], bit) & bit) == 0) {
+                return w*64 + idx;
             }
-            bin->current_run = run;
-            bin->n_free += (BLOCK_SIZE-64)/n_bytes;
-            bin->n_runs += 1;
-        } else if (!bin->current_run || bin->current_run->n_free == 0) {
-            /* current run is full but not bin, select another non-full one */
-            run = bin->runs;
-            bin->runs = run->next;
-            bin->current_run = run;
-        } else {
-            run = bin->current_run;
         }
+    }
+}
+
+/* make a non-full run the bin's current run, bin lock must be held */
+static arena_run_t* arena_bin_switch_run(arena_t *arena, arena_bin_t *bin, uint32_t binind) {
+    arena_run_t *run = NULL, *current = bin->current_run;
 
-        /* now we are guaranteed to have space in current_run */
-        for (i=0; i<(BLOCK_SIZE-64)/n_bytes; ++i) {
-            mask = 1<<(i%8);
-            if ((run->bitmap[i/8] & mask) == 0) {
-                run->bitmap[i/8] |= mask;
-                result = (void*) ((uintptr_t)(run->nvm_run+1) + n_bytes*i);
+    while (1) {
+        /* runs that filled up again while on the list are dropped, the next free re-adds them */
+        while ((run = bin->runs) != NULL) {
+            bin->runs = run->next;
+            run->on_list = 0;
+            if (run->n_free > 0) {
                 break;
             }
         }
-        run->n_free -= 1;
-        bin->n_free -= 1;
-
+        if (run != NULL || !recovery_pending()) {
+            break;
+        }
+        /* chunks left from a previous run are recovered before the heap grows, they may hold runs of this bin as well
+           as free pages. recovered runs are added to their bins, so the lock is dropped meanwhile */
         pthread_mutex_unlock(&bin->mtx);
-    } else {
-        /* large request, round up to the nearest multiple of BLOCK_SIZE */
-        n_bytes = (n_bytes & ~4095) + (n_bytes % BLOCK_SIZE != 0 ? BLOCK_SIZE : 0);
-        if ((nvm_block = arena_create_block(arena, n_bytes/BLOCK_SIZE)) == NULL) {
+        recovery_assist();
+        pthread_mutex_lock(&bin->mtx);
+        if (bin->current_run != current) {
+            /* somebody else switched in the meantime */
+            return bin->current_run;
+        }
+    }
+
+    if (run == NULL) {
+        /* no more space in bin, allocate new run */
+        if ((run = arena_create_run(arena, bin, binind)) == NULL) {
             return NULL;
         }
-        result = (void*) (nvm_block + 1);
+        bin->n_runs += 1;
     }
 
-    return result;
+    bin->current_run = run;
+    return run;
+}
+
+uint32_t arena_fill(arena_t *arena, uint32_t binind, void **slots, uint32_t n_slots) {
+    int idx;
+    uint32_t n_filled = 0;
+    arena_bin_t *bin = &arena->bins[binind];
+    arena_run_t *run = NULL;
+
+    while (n_filled < n_slots) {
+        /* take as many slots as possible from the current run without locking */
+        if ((run = bin->current_run) != NULL) {
+            while (n_filled < n_slots && (idx = arena_run_claim(run)) >= 0) {
+                slots[n_filled++] = (void*) (run->data + run->elem_size*idx);
+            }
+            if (n_filled == n_slots) {
+                break;
+            }
+        }
+
+        /* current run is full, switch unless another thread already did or a free made room */
+        pthread_mutex_lock(&bin->mtx);
+        if (bin->current_run == run && (run == NULL || run->n_free == 0)) {
+            if (arena_bin_switch_run(arena, bin, binind) == NULL) {
+                pthread_mutex_unlock(&bin->mtx);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&bin->mtx);
+    }
+
+    return n_filled;
 }
 
-void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
+void arena_bin_add_run(arena_run_t *run) {
+    arena_bin_t *bin = run->bin;
+
+    pthread_mutex_lock(&bin->mtx);
+    if (run != bin->current_run && !run->on_list) {
+        run->next = bin->runs;
+        bin->runs = run;
+        run->on_list = 1;
+    }
+    pthread_mutex_unlock(&bin->mtx);
+}
+
+void arena_release(void **slots, uint32_t n_slots) {
+    uint32_t i;
+    int run_idx;
+    uint64_t bit;
+    arena_run_t *run = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+
+    for (i=0; i<n_slots; ++i) {
+        nvm_run = (nvm_run_header_t*) block_header_of(slots[i]);
+        run = nvm_run->vdata;
+        run_idx = ((uintptr_t)slots[i] - run->data) / run->elem_size;
+
+        bit = 1ul << (run_idx % 64);
+
+        /* mark slot as free in volatile memory, only count it if the bit was set so n_free never exceeds the clear bits */
+        if ((__sync_fetch_and_and(&run->bitmap[run_idx/64], ~bit) & bit) == 0) {
+            continue;
+        }
+        /* if run was full add it back to bin's list */
+        if (__sync_fetch_and_add(&run->n_free, 1) == 0) {
+            arena_bin_add_run(run);
+        }
+    }
+}
+
+void arena_free(tcache_t *tcache, void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
     arena_t *arena = NULL;
-    arena_block_t *block = NULL;
-    arena_bin_t *bin = NULL;
-    arena_run_t *run = NULL, *tmp_run = NULL;
+    arena_run_t *run = NULL;
     nvm_block_header_t *nvm_block = NULL;
     nvm_run_header_t *nvm_run = NULL;
     int run_idx;
+    persist_domain_t domain;
+
+    /* first, get the nvm run/block metadata located at beginning of the block or run */
+    nvm_block = (nvm_block_header_t*) block_header_of(ptr);
+    persist_domain_init(&domain);
 
-    /* first, get the nvm run/block metadata located at beginning of page */
-    nvm_block = (nvm_block_header_t*) ((uintptr_t)ptr & ~4095);
+    /* a chunk left from a previous run is recovered before its first free, afterwards all of its runs have a VHeader */
+    recovery_ensure(nvm_block);
 
     if (GET_USAGE(nvm_block->state) == USAGE_BLOCK) {
         /* freeing a large element */
-        block = (arena_block_t*) malloc(sizeof(arena_block_t));
-        block->nvm_block = nvm_block;
-        block->n_pages = nvm_block->n_pages;
-        block->arena = arenas[nvm_block->arena_id];
-        arena = block->arena;
+        arena = arenas[nvm_block->arena_id];
+
+        /* scans must read the header again before it can say free, either with the links or right away */
+        arena_mark_free(nvm_block, &domain);
+        if (!link_ptr1) {
+            persist_domain_commit(&domain);
+        }
 
         /* store link pointers in header */
         if (link_ptr1) {
@@ -176,27 +384,32 @@ void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, vo
                 nvm_block->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
             }
 
-            sfence();
+            compiler_barrier();
             nvm_block->state = USAGE_BLOCK | STATE_FREEING;
-            sfence();
+            persist_domain_add(&domain, nvm_block);
+            persist_domain_commit(&domain);
 
             *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-            PERSIST(*link_ptr1);
+            persist_domain_add(&domain, link_ptr1);
             if (link_ptr2) {
                 *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                PERSIST(*link_ptr2);
+                persist_domain_add(&domain, link_ptr2);
             }
+            persist_domain_commit(&domain);
         }
 
-        /* mark block as free on NVM */
-        nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
-        sfence();
+        /* mark block as free on NVM, stamping the version first keeps the recovery thread from picking it up */
+        nvm_block->vdata = NULL;
+        nvm_block->version = current_version;
         memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
-        PERSIST(nvm_block);
+        compiler_barrier();
+        nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
+        persist_domain_add(&domain, nvm_block);
+        persist_domain_commit(&domain);
 
-        /* add the block back into the arena's free list */
+        /* add the block back into the arena's free list, merging it with free neighbours */
         pthread_mutex_lock(&arena->mtx);
-        tree_add(&block->link, block_node_compare, &arena->free_pageruns);
+        arena_add_free_block(arena, nvm_block);
         pthread_mutex_unlock(&arena->mtx);
 
     } else if (GET_USAGE(nvm_block->state) == USAGE_RUN) {
@@ -206,26 +419,8 @@ void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, vo
         /* make sure no concurrent deallocations/activations are performed on the same run */
         while (!__sync_bool_compare_and_swap(&nvm_run->state, (USAGE_RUN | STATE_INITIALIZED), (USAGE_RUN | STATE_PREFREE))) {}
 
-        /* check if we need to create a VHeader */
         run = nvm_run->vdata;
-        if (nvm_run->version < current_version) {
-            printf("nvm_run->version < current_version!\n");
-            tmp_run = arena_create_run_header(nvm_run);
-            pthread_mutex_lock(&tmp_run->bin->mtx);
-            /* after locking, make sure nobody else has created a VHeader yet */
-            if (run == nvm_run->vdata) {
-                nvm_run->vdata = tmp_run;
-                sfence(); /* need to guarantee that vdata is set before version */
-                nvm_run->version = current_version;
-            } else {
-                free(tmp_run);
-            }
-            pthread_mutex_unlock(&tmp_run->bin->mtx);
-            run = nvm_run->vdata;
-        }
-
-        bin = run->bin;
-        run_idx = ((uintptr_t)ptr - (uintptr_t)(nvm_run+1)) / run->elem_size;
+        run_idx = ((uintptr_t)ptr - run->data) / run->elem_size;
 
         /* store bit to be changed */
         nvm_run->bit_idx = run_idx;
@@ -239,39 +434,40 @@ void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, vo
                 nvm_run->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
             }
 
-            sfence();
+            compiler_barrier();
             nvm_run->state = USAGE_RUN | STATE_FREEING;
-            sfence();
+            persist_domain_add(&domain, nvm_run);
+            persist_domain_commit(&domain);
 
             *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-            PERSIST(*link_ptr1);
+            persist_domain_add(&domain, link_ptr1);
             if (link_ptr2) {
                 *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                PERSIST(*link_ptr2);
+                persist_domain_add(&domain, link_ptr2);
             }
         }
 
-        /* mark slot as free on NVM */
-        sfence();
-        nvm_run->bitmap[run_idx/8] &= ~(1<<(run_idx%8));
-        sfence();
-        nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
-        sfence();
+        /* mark slot as free on NVM, together with the links it must be persistent before the header is reset */
+        *NVM_RUN_BITMAP_WORD(nvm_run, run_idx) &= ~NVM_RUN_BIT(run_idx);
+        persist_domain_add(&domain, NVM_RUN_BITMAP_WORD(nvm_run, run_idx));
+        if (link_ptr1) {
+            persist_domain_commit(&domain);
+        }
+
+        /* the state is written last as it releases the run to concurrent activations and deallocations */
         nvm_run->bit_idx = -1;
         memset(nvm_run->on, 0, 2*sizeof(nvm_ptrset_t));
-        PERSIST(nvm_run);
+        compiler_barrier();
+        nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
+        persist_domain_add(&domain, nvm_run);
+        persist_domain_commit(&domain);
 
-        /* mark slot as free in volatile memory */
-        pthread_mutex_lock(&bin->mtx);
-        run->bitmap[run_idx/8] &= ~(1<<(run_idx%8));
-        run->n_free += 1;
-        bin->n_free += 1;
-        /* if run was full, add it back to bin's free list */
-        if (run != bin->current_run && run->n_free == 1) {
-            run->next = bin->runs;
-            bin->runs = run;
+        /* the slot stays reserved in volatile memory while it sits in the thread cache */
+        if (tcache) {
+            tcache_dalloc(tcache, arena_size_class(run->elem_size), ptr);
+        } else {
+            arena_release(&ptr, 1);
         }
-        pthread_mutex_unlock(&bin->mtx);
 
     } else {
         /* false free if we get here */
@@ -279,50 +475,89 @@ void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, vo
     }
 }
 
-arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t n_bytes) {
-    nvm_run_header_t *nvm_run = NULL;
+/* initialize a fresh run header on NVM, the run's pages must already be registered in the page map */
+static void arena_init_nvm_run(arena_t *arena, arena_run_t *run, const arena_run_geometry_t *geometry) {
+    nvm_run_header_t *nvm_run = run->nvm_run;
+
+    if (geometry->hdr_lines > 1) {
+        /* clear the bitmap extension line */
+        memset((void*)(nvm_run+1), 0, CACHE_LINE_SIZE);
+        PERSIST((void*)(nvm_run+1));
+    }
+
+    nvm_run->hdr_lines = geometry->hdr_lines;
+    nvm_run->n_bytes = geometry->elem_size;
+    nvm_run->n_pages = geometry->n_pages;
+    nvm_run->vdata = run;
+    memset(nvm_run->on, 0, 2*sizeof(nvm_ptrset_t));
+    nvm_run->bitmap = 0;
+    nvm_run->bit_idx = -1;
+    nvm_run->arena_id = arena->id;
+    nvm_run->version = current_version;
+    sfence();
+    nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
+    PERSIST(nvm_run);
+}
+
+/* record the pages of a run in its chunk's page map so that interior pointers find the header */
+static void arena_map_run_pages(nvm_run_header_t *nvm_run, uint32_t binind) {
+    uint32_t i, n_pages = run_geometry[binind].n_pages;
+    nvm_page_map_t *page_map = arena_page_map(nvm_run);
+    uint32_t first_page = arena_page_index(nvm_run);
+
+    for (i=0; i<n_pages; ++i) {
+        page_map->run_offset[first_page + i] = i;
+    }
+    PERSIST_RANGE(&page_map->run_offset[first_page], n_pages);
+    page_map->page_info[first_page] = PAGE_INFO(USAGE_RUN, binind);
+    memset(&page_map->page_info[first_page + 1], 0, n_pages - 1);
+    PERSIST_RANGE(&page_map->page_info[first_page], n_pages);
+}
+
+arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t binind) {
+    const arena_run_geometry_t *geometry = &run_geometry[binind];
     arena_block_t *free_block = NULL;
     arena_run_t *run = NULL;
 
-    assert(n_bytes > 0);
-
     /* what comes next should be protected */
     pthread_mutex_lock(&arena->mtx);
 
-    /* find a free block for one page */
-    if ((free_block = tree_upper_bound(1, arena->free_pageruns)) == NULL) {
+    /* find a free block for the run's pages */
+    if ((free_block = arena_best_fit(arena, geometry->n_pages)) == NULL) {
         if ((free_block = arena_add_chunk(arena)) == NULL) {
             return NULL;
         }
     } else {
-        assert(free_block->n_pages >= 1);
-        tree_del(&free_block->link, &arena->free_pageruns);
+        assert(free_block->n_pages >= geometry->n_pages);
+        arena_unlist_block(arena, free_block);
     }
 
-    run = (arena_run_t*) malloc(sizeof(arena_run_t));
+    run = (arena_run_t*) slab_alloc(&arena->run_cache);
     run->bin = bin;
-    run->elem_size = n_bytes;
-    run->n_free = run->n_max = (BLOCK_SIZE-64) / n_bytes;
-    memset(run->bitmap, 0, 8);
+    run->elem_size = geometry->elem_size;
+    run->n_max = geometry->n_slots;
+    run->n_words = (run->n_max + 63) / 64;
+    run->n_free = run->n_max;
+    memset(run->bitmap, 0, sizeof(run->bitmap));
+    if (run->n_max % 64) {
+        /* bits beyond the last slot are never claimed */
+        run->bitmap[run->n_words-1] = ~0ul << (run->n_max % 64);
+    }
+    run->on_list = 0;
+    run->next = NULL;
 
-    if (free_block->n_pages > 1) {
+    if (free_block->n_pages > geometry->n_pages) {
         /* create volatile and nonvolatile run objects at the end of the free block */
-        run->nvm_run = (nvm_run_header_t*) ((uintptr_t)free_block->nvm_block + (free_block->n_pages - 1) * BLOCK_SIZE);
-        nvm_run = run->nvm_run;
-        memset(nvm_run, 0, sizeof(nvm_run_header_t));
-        nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
-        nvm_run->n_bytes = n_bytes;
-        nvm_run->vdata = run;
-        nvm_run->bit_idx = -1;
-        nvm_run->arena_id = arena->id;
-        nvm_run->version = current_version;
-        PERSIST(nvm_run);
+        run->nvm_run = (nvm_run_header_t*) ((uintptr_t)free_block->nvm_block + (free_block->n_pages - geometry->n_pages) * BLOCK_SIZE);
+        run->data = (uintptr_t)run->nvm_run + geometry->hdr_lines * CACHE_LINE_SIZE;
+        arena_map_run_pages(run->nvm_run, binind);
+        arena_init_nvm_run(arena, run, geometry);
 
         /* shrink the free block and reinsert into tree */
-        free_block->n_pages -= 1;
+        free_block->n_pages -= geometry->n_pages;
         free_block->nvm_block->n_pages = free_block->n_pages;
         PERSIST(free_block->nvm_block);
-        tree_add(&free_block->link, block_node_compare, &arena->free_pageruns);
+        arena_list_block(arena, free_block);
 
         /* now we can release the lock */
         pthread_mutex_unlock(&arena->mtx);
@@ -331,23 +566,12 @@ arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t n_bytes
         pthread_mutex_unlock(&arena->mtx);
 
         run->nvm_run = (nvm_run_header_t*) free_block->nvm_block;
-        nvm_run = run->nvm_run;
-        free(free_block);
-
-        /* convert free block to run */
-        // TODO: check that this is failure safe
-        memset(nvm_run, 0, sizeof(nvm_run_header_t));
-        nvm_run->vdata = run;
-        memset(nvm_run->bitmap, 0, 8);
-        nvm_run->bit_idx = -1;
-        nvm_run->arena_id = arena->id;
-        nvm_run->version = current_version;
-        sfence();
-        nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
-        nvm_run->n_bytes = n_bytes;
-        PERSIST(nvm_run);
+        run->data = (uintptr_t)run->nvm_run + geometry->hdr_lines * CACHE_LINE_SIZE;
+        slab_free(&arena->block_cache, free_block);
 
-        assert(nvm_run->state == (USAGE_RUN | STATE_INITIALIZED));
+        /* convert free block to run, the state is written last so a crash leaves a valid free block */
+        arena_map_run_pages(run->nvm_run, binind);
+        arena_init_nvm_run(arena, run, geometry);
     }
 
     return run;
@@ -356,26 +580,36 @@ arena_run_t* arena_create_run(arena_t *arena, arena_bin_t *bin, uint32_t n_bytes
 nvm_block_header_t* arena_create_block(arena_t *arena, uint32_t n_pages) {
     nvm_block_header_t *nvm_block = NULL;
     arena_block_t *free_block = NULL;
+    nvm_page_map_t *page_map = NULL;
+    uint32_t page_idx;
 
     /* what comes next should be protected */
     pthread_mutex_lock(&arena->mtx);
 
-    /* find a free block for the specified number of pages */
-    if ((free_block = tree_upper_bound(n_pages, arena->free_pageruns)) == NULL) {
+    /* find a free block for the specified number of pages, chunks left from a previous run are recovered before the heap grows */
+    while ((free_block = arena_best_fit(arena, n_pages)) == NULL && recovery_pending()) {
+        pthread_mutex_unlock(&arena->mtx);
+        recovery_assist();
+        pthread_mutex_lock(&arena->mtx);
+    }
+    if (free_block == NULL) {
         if ((free_block = arena_add_chunk(arena)) == NULL) {
             return NULL;
         }
     } else {
         assert(free_block->n_pages >= n_pages);
-        tree_del(&free_block->link, &arena->free_pageruns);
+        arena_unlist_block(arena, free_block);
     }
 
     if (free_block->n_pages > n_pages) {
         /* create volatile and nonvolatile block objects at the end of the free block */
         nvm_block = (nvm_block_header_t*) ((uintptr_t)free_block->nvm_block + (free_block->n_pages - n_pages) * BLOCK_SIZE);
+        arena_map_block_pages(nvm_block, n_pages);
         nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
         nvm_block->n_pages = n_pages;
         nvm_block->arena_id = arena->id;
+        nvm_block->version = current_version;
+        nvm_block->vdata = NULL;
         PERSIST(nvm_block);
 
         /* shrink the free block and reinsert into tree */
@@ -383,7 +617,7 @@ nvm_block_header_t* arena_create_block(arena_t *arena, uint32_t n_pages) {
         free_block->nvm_block->n_pages -= n_pages;
         assert(free_block->nvm_block->n_pages > 0);
         PERSIST(free_block->nvm_block);
-        tree_add(&free_block->link, block_node_compare, &arena->free_pageruns);
+        arena_list_block(arena, free_block);
 
         /* now we can release the lock */
         pthread_mutex_unlock(&arena->mtx);
@@ -391,6 +625,16 @@ nvm_block_header_t* arena_create_block(arena_t *arena, uint32_t n_pages) {
         /* block is the size we want, lock can be released right away in this case */
         pthread_mutex_unlock(&arena->mtx);
         nvm_block = free_block->nvm_block;
+        slab_free(&arena->block_cache, free_block);
+        arena_map_block_pages(nvm_block, n_pages);
+    }
+
+    /* a crash during run creation may have left a page map entry behind */
+    page_map = arena_page_map(nvm_block);
+    page_idx = arena_page_index(nvm_block);
+    if (page_map->run_offset[page_idx] != 0) {
+        page_map->run_offset[page_idx] = 0;
+        PERSIST(&page_map->run_offset[page_idx]);
     }
 
     return nvm_block;
@@ -398,31 +642,38 @@ nvm_block_header_t* arena_create_block(arena_t *arena, uint32_t n_pages) {
 
 arena_block_t* arena_add_chunk(arena_t *arena) {
     nvm_chunk_header_t *chunk = NULL;
+    nvm_page_map_t *page_map = NULL;
     nvm_block_header_t *nvm_block = NULL;
     arena_block_t *free_block = NULL;
 
     if ((chunk = (nvm_chunk_header_t*) activate_more_chunks(1)) == NULL) {
         return NULL;
     }
-    nvm_block = (nvm_block_header_t*) ((uintptr_t)chunk + BLOCK_SIZE);
+    page_map = (nvm_page_map_t*) (chunk+1);
+    nvm_block = (nvm_block_header_t*) ((uintptr_t)chunk + ARENA_FIRST_PAGE*BLOCK_SIZE);
 
     /* first initialize the chunk */
-    memset(chunk->object_table, 0, 63*sizeof(nvm_object_table_entry_t));
+    memset(chunk->object_table, 0, sizeof(chunk->object_table));
     chunk->state = USAGE_ARENA | STATE_INITIALIZING;
-    chunk->next_ot_chunk = (uintptr_t)NULL;
     strncpy(chunk->signature, NVM_CHUNK_SIGNATURE, 47);
     chunk->signature[46] = '\0';
     PERSIST_RANGE(chunk, BLOCK_SIZE);
+    memset(page_map, 0, sizeof(nvm_page_map_t));
+    page_map->page_info[ARENA_FIRST_PAGE] = PAGE_INFO(USAGE_FREE, 0);
+    PERSIST_RANGE(page_map, sizeof(nvm_page_map_t));
 
     /* create initial free block */
-    free_block = (arena_block_t*) malloc(sizeof(arena_block_t));
+    free_block = (arena_block_t*) slab_alloc(&arena->block_cache);
     free_block->nvm_block = nvm_block;
-    free_block->n_pages = CHUNK_SIZE / BLOCK_SIZE - 1;
+    free_block->n_pages = CHUNK_PAGES - ARENA_FIRST_PAGE;
     free_block->arena = arena;
 
     memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
     nvm_block->state = USAGE_FREE | STATE_INITIALIZED; /* no need to worry, as long as chunk header is still in INITIALIZING */
-    nvm_block->n_pages = CHUNK_SIZE / BLOCK_SIZE - 1;
+    nvm_block->n_pages = CHUNK_PAGES - ARENA_FIRST_PAGE;
+    nvm_block->arena_id = arena->id;
+    nvm_block->version = current_version;
+    nvm_block->vdata = NULL;
     PERSIST(nvm_block);
 
     /* set chunk's status to initialized */
@@ -433,58 +684,114 @@ arena_block_t* arena_add_chunk(arena_t *arena) {
 }
 
 arena_run_t* arena_create_run_header(nvm_run_header_t *nvm_run) {
-    int i=0;
+    uint32_t i, binind = arena_size_class(nvm_run->n_bytes);
     arena_t *arena = arenas[nvm_run->arena_id];
-    arena_run_t *run = (arena_run_t*) malloc(sizeof(arena_run_t));
+    arena_run_t *run = (arena_run_t*) slab_alloc(&arena->run_cache);
 
-    memcpy(run->bitmap, nvm_run->bitmap, 8);
     run->nvm_run = nvm_run;
-    run->bin = &arena->bins[nvm_run->n_bytes/64 - 1];
+    run->data = NVM_RUN_DATA(nvm_run);
+    run->bin = &arena->bins[binind];
     run->elem_size = nvm_run->n_bytes;
-    run->n_free = 0;
-    run->n_max = (BLOCK_SIZE-64) / run->elem_size;
-    for (i=0; i<run->n_max; ++i) {
-        if ((run->bitmap[i/8] & 1<<(i%8)) == 0) {
-            ++run->n_free;
-        }
+    run->n_max = run_geometry[binind].n_slots;
+    run->n_words = (run->n_max + 63) / 64;
+    run->n_free = run->n_max;
+    memset(run->bitmap, 0, sizeof(run->bitmap));
+    for (i=0; i<run->n_words; ++i) {
+        run->bitmap[i] = *NVM_RUN_BITMAP_WORD(nvm_run, i*64);
+        run->n_free -= __builtin_popcountll(run->bitmap[i]);
+    }
+    if (run->n_max % 64) {
+        run->bitmap[run->n_words-1] |= ~0ul << (run->n_max % 64);
     }
+    run->on_list = 0;
     run->next = NULL;
 
     return run;
 }
 
-arena_block_t* arena_create_block_header(nvm_block_header_t *nvm_block) {
-    arena_block_t *block = (arena_block_t*) malloc(sizeof(arena_block_t));
-    block->nvm_block = nvm_block;
-    block->n_pages = nvm_block->n_pages;
-    block->arena = arenas[nvm_block->arena_id];
-    return block;
+/* allow scans to skip an allocated block, only once its header is persistent */
+void arena_mark_allocated(nvm_block_header_t *nvm_block) {
+    arena_page_map(nvm_block)->page_info[arena_page_index(nvm_block)] = PAGE_INFO(USAGE_BLOCK, 0);
 }
 
-void arena_teardown(arena_t *arena) {
-    arena_block_t *node = NULL, *tmp = NULL;
-    uint8_t i = 0;
-    arena_bin_t *bin = NULL;
-    arena_run_t *run = NULL;
+/* stop scans from skipping a block that is about to be freed, must be persistent before the header is */
+void arena_mark_free(nvm_block_header_t *nvm_block, persist_domain_t *domain) {
+    uint8_t *info = &arena_page_map(nvm_block)->page_info[arena_page_index(nvm_block)];
+
+    if (*info != PAGE_INFO(USAGE_FREE, 0)) {
+        *info = PAGE_INFO(USAGE_FREE, 0);
+        persist_domain_add(domain, info);
+    }
+}
+
+/* give a run of a previous session its VHeader and hand its free slots back to the bin */
+void arena_restore_run(nvm_run_header_t *nvm_run) {
+    arena_run_t *run = arena_create_run_header(nvm_run);
+
+    nvm_run->vdata = run;
+    sfence(); /* need to guarantee that vdata is set before version */
+    nvm_run->version = current_version;
+    PERSIST(nvm_run);
+    if (run->n_free > 0) {
+        arena_bin_add_run(run);
+    }
+}
+
+void arena_destroy_run_header(arena_run_t *run) {
+    slab_free(&arenas[run->nvm_run->arena_id]->run_cache, run);
+}
 
-    /* free all elements of the free block tree */
-    tree_for_each_entry_safe(node, tmp, arena->free_pageruns, link) {
-        tree_del(&node->link, &arena->free_pageruns);
-        free(node);
-    }
-    /* iterate through bins and delete all run headers */
-    for (i=0; i<31; ++i) {
-        bin = &arena->bins[i];
-        if (bin->current_run) {
-            free(bin->current_run);
-            bin->current_run = NULL;
+void arena_add_free_block(arena_t *arena, nvm_block_header_t *nvm_block) {
+    arena_block_t *block = NULL, *neighbour = NULL;
+    nvm_block_header_t *nvm_neighbour = NULL;
+    uint32_t page_idx = arena_page_index(nvm_block), head_idx;
+
+    /* absorb a free upper neighbour, persisting the grown size is the atomic step */
+    if (page_idx + nvm_block->n_pages < CHUNK_PAGES) {
+        nvm_neighbour = (nvm_block_header_t*) ((uintptr_t)nvm_block + nvm_block->n_pages * BLOCK_SIZE);
+        if (arena_block_listed(arena, nvm_neighbour)) {
+            neighbour = nvm_neighbour->vdata;
+            arena_unlist_block(arena, neighbour);
+            nvm_block->n_pages += neighbour->n_pages;
+            PERSIST(nvm_block);
+            /* scans jump over the inside of free blocks, the mark needs not be persistent */
+            arena_page_map(nvm_block)->page_info[page_idx + nvm_block->n_pages - neighbour->n_pages] = 0;
+            slab_free(&arena->block_cache, neighbour);
         }
-        while (bin->runs) {
-            run = bin->runs;
-            bin->runs = bin->runs->next;
-            free(run);
+    }
+
+    /* let a free lower neighbour absorb the block, found through the tag on its last page */
+    if (page_idx > ARENA_FIRST_PAGE) {
+        head_idx = arena_page_map(nvm_block)->free_head[page_idx - 1];
+        nvm_neighbour = (nvm_block_header_t*) ((uintptr_t)nvm_block - (page_idx - head_idx) * BLOCK_SIZE);
+        if (head_idx >= ARENA_FIRST_PAGE && head_idx < page_idx &&
+            arena_block_listed(arena, nvm_neighbour) && head_idx + nvm_neighbour->n_pages == page_idx) {
+            block = nvm_neighbour->vdata;
+            arena_unlist_block(arena, block);
+            nvm_neighbour->n_pages += nvm_block->n_pages;
+            PERSIST(nvm_neighbour);
+            /* the absorbed header keeps the current version so the recovery thread skips it */
+            nvm_block->vdata = NULL;
+            nvm_block->version = current_version;
+            arena_page_map(nvm_block)->page_info[page_idx] = 0;
+            nvm_block = nvm_neighbour;
         }
     }
+
+    if (block == NULL) {
+        block = (arena_block_t*) slab_alloc(&arena->block_cache);
+        block->nvm_block = nvm_block;
+        block->arena = arena;
+    }
+    block->n_pages = nvm_block->n_pages;
+    arena_list_block(arena, block);
+}
+
+void arena_teardown(arena_t *arena) {
+    /* the descriptors of free blocks and runs go away with their slabs */
+    slab_teardown(&arena->block_cache);
+    slab_teardown(&arena->run_cache);
+
     /* free arena object itself */
     free(arena);
 }
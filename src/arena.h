@@ -9,16 +9,29 @@
 
 void arena_init(arena_t *arena, uint32_t id, nvm_chunk_header_t *first_chunk, int create_initial_block);
 
+uint32_t arena_size_class(uint32_t n_bytes);
+
 void* arena_allocate(arena_t *arena, uint32_t n_bytes);
 
-void arena_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+uint32_t arena_fill(arena_t *arena, uint32_t binind, void **slots, uint32_t n_slots);
+
+void arena_release(void **slots, uint32_t n_slots);
+
+void arena_bin_add_run(arena_run_t *run);
+
+void arena_free(tcache_t *tcache, void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
 
 arena_run_t* arena_create_run_header(nvm_run_header_t *nvm_run);
-arena_block_t* arena_create_block_header(nvm_block_header_t *nvm_block);
 
-int run_node_compare(const void *_a, const void *_b);
+void arena_mark_allocated(nvm_block_header_t *nvm_block);
+
+void arena_mark_free(nvm_block_header_t *nvm_block, persist_domain_t *domain);
+
+void arena_restore_run(nvm_run_header_t *nvm_run);
+
+void arena_destroy_run_header(arena_run_t *run);
 
-int block_node_compare(const void *_a, const void *_b);
+void arena_add_free_block(arena_t *arena, nvm_block_header_t *nvm_block);
 
 void arena_teardown(arena_t *arena);
 
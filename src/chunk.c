@@ -22,7 +22,7 @@
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
-inline void error_and_exit(char *msg, ...) {
+static inline void error_and_exit(char *msg, ...) {
     va_list args;
     va_start(args, msg);
     vfprintf(stderr, msg, args);
@@ -37,10 +37,12 @@ static int             backing_file_fd = -1;
 static char            *backing_file_path = NULL;
 static int             meta_file_fd = -1;
 static char            *meta_file_path = NULL;
+static uint64_t        meta_size = 0;
+static char            *snapshot_file_path = NULL;
 static uint64_t        next_chunk = 0;
 static pthread_mutex_t chunk_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-inline int nvm_fallocate(int fd, off_t offset, off_t len) {
+static inline int nvm_fallocate(int fd, off_t offset, off_t len) {
 #ifdef __linux
     return posix_fallocate(fd, offset, len);
 #elif __APPLE__
@@ -58,7 +60,7 @@ inline int nvm_fallocate(int fd, off_t offset, off_t len) {
 #endif
 }
 
-inline int open_existing_file(char *path) {
+static inline int open_existing_file(char *path) {
     int fd=-1;
     struct stat stbuf;
     if (stat(path, &stbuf) < 0) {
@@ -69,7 +71,7 @@ inline int open_existing_file(char *path) {
     return fd;
 }
 
-inline int open_empty_or_create_file(char *path) {
+static inline int open_empty_or_create_file(char *path) {
     int fd=-1;
     struct stat stbuf;
     if (stat(path, &stbuf) < 0) {
@@ -81,7 +83,7 @@ inline int open_empty_or_create_file(char *path) {
     return fd;
 }
 
-inline uint64_t get_file_size(char *path) {
+static inline uint64_t get_file_size(char *path) {
     struct stat stbuf;
     if (stat(path, &stbuf) != 0) {
         return 0;
@@ -101,13 +103,15 @@ void* initalize_nvm_space(const char *workspace_path, uint64_t max_num_chunks) {
     base_path_length = strlen(workspace_path);
     backing_file_path = (char*) malloc(base_path_length + 1 + 7 + 1); /* <workspace_path> + '/' + 'backing' + '\0' */
     meta_file_path    = (char*) malloc(base_path_length + 1 + 4 + 1); /* <workspace_path> + '/' + 'meta' + '\0' */
+    snapshot_file_path = (char*) malloc(base_path_length + 1 + 8 + 1); /* <workspace_path> + '/' + 'snapshot' + '\0' */
     sprintf(backing_file_path, "%s/backing", workspace_path);
     sprintf(meta_file_path, "%s/meta", workspace_path);
+    sprintf(snapshot_file_path, "%s/snapshot", workspace_path);
 
     return chunk_region_start;
 }
 
-void initialize_chunks() {
+void initialize_chunks(uint64_t n_meta_bytes) {
     backing_file_fd = open_empty_or_create_file(backing_file_path);
     /* >>>> HACK begin: call nvm_fallocate with 1MB first to prevent PMFS from switching to huge pages */
     if (nvm_fallocate(backing_file_fd, 0, 1024*1024) != 0)
@@ -115,10 +119,11 @@ void initialize_chunks() {
     /* <<<< HACK end */
 
     /* open new meta file */
+    meta_size = (n_meta_bytes + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
     meta_file_fd = open_empty_or_create_file(meta_file_path);
-    if (nvm_fallocate(meta_file_fd, 0, BLOCK_SIZE) != 0)
+    if (nvm_fallocate(meta_file_fd, 0, meta_size) != 0)
         error_and_exit("unable to ensure file size of %s", meta_file_path);
-    if ((meta_info = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, meta_file_fd, 0)) == MAP_FAILED)
+    if ((meta_info = mmap(NULL, meta_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, meta_file_fd, 0)) == MAP_FAILED)
         error_and_exit("error mapping meta info\n");
 }
 
@@ -137,7 +142,8 @@ uint64_t recover_chunks() {
 
     /* open existing meta file */
     meta_file_fd = open_existing_file(meta_file_path);
-    if ((meta_info = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, meta_file_fd, 0)) == MAP_FAILED)
+    meta_size = get_file_size(meta_file_path);
+    if ((meta_info = mmap(NULL, meta_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, meta_file_fd, 0)) == MAP_FAILED)
         error_and_exit("error mapping meta info\n");
 
     return next_chunk;
@@ -168,10 +174,51 @@ void* activate_more_chunks(uint64_t n_chunks) {
     return next_chunk_addr;
 }
 
+uint64_t active_chunks() {
+    return next_chunk;
+}
+
+void* create_snapshot(uint64_t n_bytes) {
+    void *snapshot = NULL;
+    int fd = -1;
+
+    /* unlike the backing and meta files, failing here only costs the next start a full recovery */
+    if ((fd = open(snapshot_file_path, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0) {
+        return NULL;
+    }
+    if (nvm_fallocate(fd, 0, n_bytes) != 0 ||
+        (snapshot = mmap(NULL, n_bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        snapshot = NULL;
+    }
+    close(fd);
+
+    return snapshot;
+}
+
+void* open_snapshot(uint64_t *n_bytes) {
+    void *snapshot = NULL;
+    int fd = -1;
+
+    if ((*n_bytes = get_file_size(snapshot_file_path)) == 0 || (fd = open(snapshot_file_path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if ((snapshot = mmap(NULL, *n_bytes, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        snapshot = NULL;
+    }
+    close(fd);
+
+    return snapshot;
+}
+
+void close_snapshot(void *snapshot, uint64_t n_bytes) {
+    munmap(snapshot, n_bytes);
+}
+
 void teardown_nvm_space() {
     munmap(chunk_region_start, max_chunks*CHUNK_SIZE);
     chunk_region_start = NULL;
-    munmap(meta_info, BLOCK_SIZE);
+    munmap(meta_info, meta_size);
+    meta_size = 0;
     meta_info = NULL;
     close(backing_file_fd);
     backing_file_fd = -1;
@@ -181,6 +228,8 @@ void teardown_nvm_space() {
     backing_file_path = NULL;
     free(meta_file_path);
     meta_file_path = NULL;
+    free(snapshot_file_path);
+    snapshot_file_path = NULL;
     max_chunks = 0;
     next_chunk = 0;
 }
@@ -7,12 +7,20 @@
 
 void* initalize_nvm_space(const char *workspace_path, uint64_t max_num_chunks);
 
-void initialize_chunks();
+void initialize_chunks(uint64_t n_meta_bytes);
 
 uint64_t recover_chunks();
 
 void* activate_more_chunks(uint64_t n_chunks);
 
+uint64_t active_chunks();
+
+void* create_snapshot(uint64_t n_bytes);
+
+void* open_snapshot(uint64_t *n_bytes);
+
+void close_snapshot(void *snapshot, uint64_t n_bytes);
+
 void teardown_nvm_space();
 
 #endif /* CHUNK_H_ */
@@ -0,0 +1,271 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "huge.h"
+#include "recovery.h"
+#include "tcache.h"
+#include "util.h"
+
+extern void *nvm_start;
+extern uint64_t current_version;
+extern arena_t **arenas;
+extern nvm_epoch_record_t *epoch_records;
+
+/* find the header of the huge extent, large block or run holding ptr and return which of them it is */
+static char epoch_header_of(void *ptr, void **header) {
+    nvm_block_header_t *nvm_block = NULL;
+
+    if (__NVM_ABS_TO_REL(ptr) % CHUNK_SIZE == sizeof(nvm_huge_header_t)) {
+        *header = (void*) ((uintptr_t)ptr - sizeof(nvm_huge_header_t));
+        return USAGE_HUGE;
+    }
+    nvm_block = (nvm_block_header_t*) block_header_of(ptr);
+    *header = nvm_block;
+    /* a large block is still free on NVM until its deferred activation is applied */
+    return GET_USAGE(nvm_block->state) == USAGE_RUN ? USAGE_RUN : USAGE_BLOCK;
+}
+
+/* write the links and the allocator state of a deferred operation to NVM and add the touched lines to the domain.
+   a replay runs before chunk recovery, it leaves the versions alone so that freed memory is picked
+   up and resets run headers a crash may have left locked by an epoch */
+static void epoch_apply(uintptr_t *op, int replaying, persist_domain_t *domain) {
+    nvm_huge_header_t *nvm_huge = NULL;
+    nvm_block_header_t *nvm_block = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+    uint64_t *word = NULL;
+    void *ptr = __NVM_REL_TO_ABS((op[0] & ~EPOCH_OP_MASK)), *header = NULL, **link = NULL;
+    int is_free = op[0] & EPOCH_OP_FREE, run_idx;
+    char state = 0;
+    uint32_t i;
+
+    for (i=0; i<EPOCH_OP_LINKS(op[0]); ++i) {
+        link = (void**) __NVM_REL_TO_ABS(op[1 + 2*i]);
+        *link = (void*) op[2 + 2*i];
+        persist_domain_add(domain, link);
+    }
+
+    switch (epoch_header_of(ptr, &header)) {
+    case USAGE_HUGE:
+        nvm_huge = (nvm_huge_header_t*) header;
+        if (is_free) {
+            if (!replaying) {
+                nvm_huge->version = current_version;
+            }
+            memset(nvm_huge->on, 0, 2*sizeof(nvm_ptrset_t));
+            compiler_barrier();
+            nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
+        } else {
+            nvm_huge->state = USAGE_HUGE | STATE_INITIALIZED;
+        }
+        persist_domain_add(domain, nvm_huge);
+        break;
+
+    case USAGE_BLOCK:
+        nvm_block = (nvm_block_header_t*) header;
+        if (is_free) {
+            if (!replaying) {
+                nvm_block->vdata = NULL;
+                nvm_block->version = current_version;
+            }
+            memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
+            compiler_barrier();
+            nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
+        } else {
+            nvm_block->state = USAGE_BLOCK | STATE_INITIALIZED;
+        }
+        persist_domain_add(domain, nvm_block);
+        break;
+
+    default:
+        nvm_run = (nvm_run_header_t*) header;
+        state = GET_STATE(nvm_run->state);
+        if (!replaying) {
+            /* the slot of a free goes back through the run's VHeader, which only exists once the chunk is recovered */
+            recovery_ensure(nvm_run);
+            /* make sure no concurrent deallocations/activations are performed on the same run */
+            while (!__sync_bool_compare_and_swap(&nvm_run->state, (USAGE_RUN | STATE_INITIALIZED),
+                                                 (USAGE_RUN | (is_free ? STATE_PREFREE : STATE_PREACTIVATE)))) {}
+        }
+        run_idx = ((uintptr_t)ptr - NVM_RUN_DATA(nvm_run)) / nvm_run->n_bytes;
+        word = NVM_RUN_BITMAP_WORD(nvm_run, run_idx);
+        if (is_free) {
+            *word &= ~NVM_RUN_BIT(run_idx);
+        } else {
+            *word |= NVM_RUN_BIT(run_idx);
+        }
+        persist_domain_add(domain, word);
+
+        /* runs are shared, a synchronous operation of another thread that committed its links is left to the log pass */
+        if (!replaying || (state != STATE_ACTIVATING && state != STATE_FREEING)) {
+            nvm_run->bit_idx = -1;
+            memset(nvm_run->on, 0, 2*sizeof(nvm_ptrset_t));
+            compiler_barrier();
+            nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
+            persist_domain_add(domain, nvm_run);
+        }
+        break;
+    }
+}
+
+/* hand deallocated memory back to the volatile structures, only done once the epoch is retired */
+static void epoch_release(tcache_t *tcache, void *ptr) {
+    nvm_block_header_t *nvm_block = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+    arena_t *arena = NULL;
+    void *header = NULL;
+
+    switch (epoch_header_of(ptr, &header)) {
+    case USAGE_HUGE:
+        huge_add_free((nvm_huge_header_t*) header);
+        break;
+
+    case USAGE_BLOCK:
+        nvm_block = (nvm_block_header_t*) header;
+        arena = arenas[nvm_block->arena_id];
+        pthread_mutex_lock(&arena->mtx);
+        arena_add_free_block(arena, nvm_block);
+        pthread_mutex_unlock(&arena->mtx);
+        break;
+
+    default:
+        nvm_run = (nvm_run_header_t*) header;
+        tcache_dalloc(tcache, arena_size_class(nvm_run->n_bytes), ptr);
+        break;
+    }
+}
+
+void epoch_begin(tcache_t *tcache) {
+    epoch_buffer_t *epoch = tcache->spare_epoch;
+
+    if (tcache->epoch != NULL) {
+        return;
+    }
+    /* without a buffer the thread simply stays in synchronous mode */
+    if (epoch != NULL || (epoch = (epoch_buffer_t*) malloc(sizeof(epoch_buffer_t))) != NULL) {
+        epoch->n_words = 0;
+        tcache->spare_epoch = NULL;
+        tcache->epoch = epoch;
+    }
+}
+
+void epoch_defer(tcache_t *tcache, void *ptr, uintptr_t op, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
+    epoch_buffer_t *epoch = tcache->epoch;
+    uintptr_t *entry = NULL;
+    uint32_t n_links = link_ptr1 ? (link_ptr2 ? 2 : 1) : 0;
+
+    if (epoch->n_words + 1 + 2*n_links > EPOCH_WORDS) {
+        epoch_sync(tcache);
+    }
+
+    /* like the allocator state, the links are only written once the epoch is synced */
+    entry = epoch->words + epoch->n_words;
+    entry[0] = __NVM_ABS_TO_REL(ptr) | op | (n_links << 1);
+    if (link_ptr1) {
+        entry[1] = __NVM_ABS_TO_REL(link_ptr1);
+        entry[2] = __NVM_ABS_TO_REL_WITH_NULL(target1);
+        if (link_ptr2) {
+            entry[3] = __NVM_ABS_TO_REL(link_ptr2);
+            entry[4] = __NVM_ABS_TO_REL_WITH_NULL(target2);
+        }
+    }
+    epoch->n_words += 1 + 2*n_links;
+}
+
+void epoch_sync(tcache_t *tcache) {
+    epoch_buffer_t *epoch = tcache->epoch;
+    nvm_epoch_record_t *record = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+    persist_domain_t domain;
+    void *ptr = NULL, *header = NULL;
+    char usage = 0;
+    uint32_t i;
+
+    if (epoch == NULL || epoch->n_words == 0) {
+        return;
+    }
+    record = epoch_records + tcache->arena->id;
+    persist_domain_init(&domain);
+
+    /* the arena's threads share its record */
+    pthread_mutex_lock(&tcache->arena->epoch_mtx);
+
+    /* step 1 - persist the entries, the packed slots whose bits are about to be set and the page map
+       entries of large blocks about to be freed */
+    memcpy(record->words, epoch->words, epoch->n_words * sizeof(uintptr_t));
+    persist_domain_add_range(&domain, record->words, epoch->n_words * sizeof(uintptr_t));
+    for (i=0; i<epoch->n_words; i+=1+2*EPOCH_OP_LINKS(epoch->words[i])) {
+        ptr = __NVM_REL_TO_ABS((epoch->words[i] & ~EPOCH_OP_MASK));
+        usage = epoch_header_of(ptr, &header);
+        if (!(epoch->words[i] & EPOCH_OP_FREE) && usage == USAGE_RUN) {
+            nvm_run = (nvm_run_header_t*) header;
+            if (nvm_run->n_bytes <= SCLASS_PACKED_MAX) {
+                persist_domain_add_range(&domain, ptr, nvm_run->n_bytes);
+            }
+        } else if ((epoch->words[i] & EPOCH_OP_FREE) && usage == USAGE_BLOCK) {
+            arena_mark_free((nvm_block_header_t*) header, &domain);
+        }
+    }
+    persist_domain_commit(&domain);
+
+    /* step 2 - commit the epoch, from here on recovery replays it */
+    record->n_words = epoch->n_words;
+    persist_domain_add(&domain, record);
+    persist_domain_commit(&domain);
+
+    /* step 3 - apply the operations in program order */
+    for (i=0; i<epoch->n_words; i+=1+2*EPOCH_OP_LINKS(epoch->words[i])) {
+        epoch_apply(epoch->words + i, 0, &domain);
+    }
+    persist_domain_commit(&domain);
+
+    /* step 4 - retire the record before the next epoch may overwrite its entries */
+    record->n_words = 0;
+    persist_domain_add(&domain, record);
+    persist_domain_commit(&domain);
+
+    pthread_mutex_unlock(&tcache->arena->epoch_mtx);
+
+    for (i=0; i<epoch->n_words; i+=1+2*EPOCH_OP_LINKS(epoch->words[i])) {
+        ptr = __NVM_REL_TO_ABS((epoch->words[i] & ~EPOCH_OP_MASK));
+        if (epoch->words[i] & EPOCH_OP_FREE) {
+            epoch_release(tcache, ptr);
+        } else if (epoch_header_of(ptr, &header) == USAGE_BLOCK) {
+            /* applied activations are persistent, scans may skip the large blocks from now on */
+            arena_mark_allocated((nvm_block_header_t*) header);
+        }
+    }
+    epoch->n_words = 0;
+}
+
+void epoch_end(tcache_t *tcache) {
+    if (tcache->epoch != NULL) {
+        epoch_sync(tcache);
+        tcache->spare_epoch = tcache->epoch;
+        tcache->epoch = NULL;
+    }
+}
+
+void epoch_replay(nvm_epoch_record_t *records, uint64_t n_records) {
+    uint64_t i, j;
+    persist_domain_t domain;
+
+    persist_domain_init(&domain);
+    for (i=0; i<n_records; ++i) {
+        if (records[i].n_words == 0) {
+            continue;
+        }
+        /* the epoch was committed but may not have been applied completely, applying it again is harmless */
+        for (j=0; j<records[i].n_words; j+=1+2*EPOCH_OP_LINKS(records[i].words[j])) {
+            epoch_apply(records[i].words + j, 1, &domain);
+        }
+        persist_domain_commit(&domain);
+        records[i].n_words = 0;
+        PERSIST(&records[i]);
+    }
+}
@@ -0,0 +1,18 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include "types.h"
+
+void epoch_begin(tcache_t *tcache);
+
+void epoch_defer(tcache_t *tcache, void *ptr, uintptr_t op, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+
+void epoch_sync(tcache_t *tcache);
+
+void epoch_end(tcache_t *tcache);
+
+void epoch_replay(nvm_epoch_record_t *records, uint64_t n_records);
+
+#endif /* EPOCH_H_ */
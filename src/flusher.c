@@ -0,0 +1,230 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "flusher.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/* every thread publishes its ranges into its own queue, flushers drain whole queues with one fence each */
+static flush_queue_t *queues = NULL;
+static pthread_mutex_t queues_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flushers[FLUSHER_MAX_THREADS];
+static uint32_t n_flushers = 0;
+static int flushers_stop = 0;
+static uint32_t flushers_idle = 0;
+static pthread_mutex_t idle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/* thread -> queue binding, invalidated like the arena bindings when the heap is torn down */
+static uint64_t queue_epoch = 0;
+static pthread_key_t queue_key;
+static pthread_once_t queue_key_once = PTHREAD_ONCE_INIT;
+static __thread flush_queue_t *thread_queue = NULL;
+static __thread uint64_t thread_queue_epoch = 0;
+
+/* called on thread exit, the flushers free the queue after its last request */
+static void flusher_thread_exit(void *arg) {
+    if (thread_queue_epoch == queue_epoch) {
+        ((flush_queue_t*) arg)->orphaned = 1;
+    }
+    thread_queue = NULL;
+}
+
+static void flusher_key_create() {
+    pthread_key_create(&queue_key, flusher_thread_exit);
+}
+
+static flush_queue_t* flusher_queue_get() {
+    flush_queue_t *queue = thread_queue;
+
+    if (thread_queue_epoch == queue_epoch) {
+        return queue;
+    }
+
+    /* first request of this thread in the current run */
+    if (posix_memalign((void**)&queue, CACHE_LINE_SIZE, sizeof(flush_queue_t)) != 0) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(flush_queue_t));
+    pthread_mutex_lock(&queues_mtx);
+    queue->next = queues;
+    queues = queue;
+    pthread_mutex_unlock(&queues_mtx);
+
+    thread_queue = queue;
+    thread_queue_epoch = queue_epoch;
+    pthread_setspecific(queue_key, queue);
+    return queue;
+}
+
+/* flush everything published so far with a single fence, the caller owns the busy flag */
+static void flusher_drain(flush_queue_t *queue) {
+    uint64_t tail = queue->tail;
+#ifndef NOFLUSH
+    uint64_t i;
+    flush_range_t *range = NULL;
+
+    for (i=queue->completed; i<tail; ++i) {
+        range = &queue->ranges[i % FLUSH_QUEUE_SIZE];
+        persist_range(range->ptr, range->n_bytes);
+    }
+#endif
+    persist_fence();
+    queue->completed = tail;
+}
+
+static int flusher_try_drain(flush_queue_t *queue) {
+    if (queue->completed == queue->tail || !__sync_bool_compare_and_swap(&queue->busy, 0, 1)) {
+        return 0;
+    }
+    flusher_drain(queue);
+    __sync_lock_release(&queue->busy);
+    return 1;
+}
+
+static void flusher_wake() {
+    if (flushers_idle > 0) {
+        pthread_mutex_lock(&idle_mtx);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mtx);
+    }
+}
+
+static void* flusher_thread(void *arg) {
+    flush_queue_t *queue = NULL, **link = NULL, *batch[FLUSHER_BATCH];
+    struct timeval now;
+    struct timespec timeout;
+    uint32_t i, n_batch;
+
+    while (!flushers_stop) {
+        /* claim a batch of queues with pending requests, the list lock is not held while flushing
+           so that the flushers and registering threads do not serialize on it */
+        n_batch = 0;
+        pthread_mutex_lock(&queues_mtx);
+        for (link = &queues; (queue = *link) != NULL; ) {
+            if (queue->orphaned && queue->completed == queue->tail && __sync_bool_compare_and_swap(&queue->busy, 0, 1)) {
+                /* the owner exited and everything it published is durable */
+                *link = queue->next;
+                free(queue);
+                continue;
+            }
+            if (n_batch < FLUSHER_BATCH && queue->completed != queue->tail && __sync_bool_compare_and_swap(&queue->busy, 0, 1)) {
+                batch[n_batch++] = queue;
+            }
+            link = &queue->next;
+        }
+        pthread_mutex_unlock(&queues_mtx);
+
+        /* a queue is not freed while its busy flag is held */
+        for (i=0; i<n_batch; ++i) {
+            flusher_drain(batch[i]);
+            __sync_lock_release(&batch[i]->busy);
+        }
+
+        if (n_batch == 0) {
+            /* nothing to do, sleep until a writer or waiter signals or the timeout catches a missed signal */
+            gettimeofday(&now, NULL);
+            timeout.tv_sec = now.tv_sec + (now.tv_usec + FLUSHER_IDLE_US) / 1000000;
+            timeout.tv_nsec = ((now.tv_usec + FLUSHER_IDLE_US) % 1000000) * 1000;
+            pthread_mutex_lock(&idle_mtx);
+            ++flushers_idle;
+            if (!flushers_stop) {
+                pthread_cond_timedwait(&idle_cond, &idle_mtx, &timeout);
+            }
+            --flushers_idle;
+            pthread_mutex_unlock(&idle_mtx);
+        }
+    }
+
+    return NULL;
+}
+
+void flusher_init() {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t i, n_wanted;
+
+    pthread_once(&queue_key_once, flusher_key_create);
+    __sync_fetch_and_add(&queue_epoch, 1);
+
+    n_wanted = n_cpus > 8 ? n_cpus / 8 : 1;
+    if (n_wanted > FLUSHER_MAX_THREADS) {
+        n_wanted = FLUSHER_MAX_THREADS;
+    }
+    flushers_stop = 0;
+    /* only started flushers are joined on teardown, without any the waiting threads drain their queues themselves */
+    for (i=0; i<n_wanted; ++i) {
+        if (pthread_create(&flushers[i], NULL, flusher_thread, NULL) != 0) {
+            break;
+        }
+    }
+    n_flushers = i;
+}
+
+uint64_t flusher_enqueue(const void *ptr, uint64_t n_bytes) {
+    flush_queue_t *queue = flusher_queue_get();
+    flush_range_t *range = NULL;
+
+    if (queue == NULL) {
+        /* no queue, persist synchronously so that every ticket is durable right away */
+        PERSIST_RANGE(ptr, n_bytes);
+        return 0;
+    }
+
+    /* the queue is full, make room by draining it ourselves or waiting for the flusher doing so */
+    while (queue->tail - queue->completed == FLUSH_QUEUE_SIZE) {
+        if (!flusher_try_drain(queue)) {
+            sched_yield();
+        }
+    }
+
+    range = &queue->ranges[queue->tail % FLUSH_QUEUE_SIZE];
+    range->ptr = ptr;
+    range->n_bytes = n_bytes;
+    /* publishing the new tail is a full barrier, flushers never see it before the range */
+    __sync_add_and_fetch(&queue->tail, 1);
+
+    flusher_wake();
+    return queue->tail;
+}
+
+void flusher_wait(uint64_t ticket) {
+    flush_queue_t *queue = thread_queue;
+
+    if (thread_queue_epoch != queue_epoch || queue == NULL) {
+        return;
+    }
+    /* rather than waiting for a flusher to get around to the queue, drain it right away */
+    while (queue->completed < ticket) {
+        if (!flusher_try_drain(queue)) {
+            sched_yield();
+        }
+    }
+}
+
+void flusher_teardown() {
+    flush_queue_t *queue = NULL;
+    uint32_t i;
+
+    pthread_mutex_lock(&idle_mtx);
+    flushers_stop = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mtx);
+    for (i=0; i<n_flushers; ++i) {
+        pthread_join(flushers[i], NULL);
+    }
+    n_flushers = 0;
+
+    /* queues of all threads, the epoch invalidates their bindings */
+    __sync_fetch_and_add(&queue_epoch, 1);
+    while ((queue = queues) != NULL) {
+        queues = queue->next;
+        free(queue);
+    }
+}
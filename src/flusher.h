@@ -0,0 +1,16 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef FLUSHER_H_
+#define FLUSHER_H_
+
+#include "types.h"
+
+void flusher_init();
+
+uint64_t flusher_enqueue(const void *ptr, uint64_t n_bytes);
+
+void flusher_wait(uint64_t ticket);
+
+void flusher_teardown();
+
+#endif /* FLUSHER_H_ */
@@ -0,0 +1,189 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "free_index.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* nodes are ordered by size, then by address so that each list hands out its lowest block first */
+static inline int free_index_less(const free_index_node_t *a, const free_index_node_t *b) {
+    return a->size < b->size || (a->size == b->size && a->addr < b->addr);
+}
+
+static inline uint32_t free_index_class(uint32_t size) {
+    return size < FREE_INDEX_CLASSES-1 ? size : FREE_INDEX_CLASSES-1;
+}
+
+/* each list is a pairing heap, meld two roots and return the new root */
+static free_index_node_t* free_index_meld(free_index_node_t *a, free_index_node_t *b) {
+    free_index_node_t *tmp = NULL;
+
+    if (free_index_less(b, a)) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    /* b becomes the first child of a */
+    b->prev = a;
+    b->next = a->child;
+    if (a->child) {
+        a->child->prev = b;
+    }
+    a->child = b;
+    return a;
+}
+
+/* two-pass pairing of a sibling list, returns the new root */
+static free_index_node_t* free_index_merge_pairs(free_index_node_t *first) {
+    free_index_node_t *a = NULL, *b = NULL, *next = NULL, *pairs = NULL, *root = NULL;
+
+    /* first pass: meld pairs from left to right, collecting them in reverse order */
+    while (first) {
+        a = first;
+        b = a->next;
+        next = b ? b->next : NULL;
+        a->prev = a->next = NULL;
+        if (b) {
+            b->prev = b->next = NULL;
+            a = free_index_meld(a, b);
+        }
+        a->next = pairs;
+        pairs = a;
+        first = next;
+    }
+
+    /* second pass: meld the pairs from right to left */
+    while (pairs) {
+        next = pairs->next;
+        pairs->next = NULL;
+        root = root ? free_index_meld(root, pairs) : pairs;
+        pairs = next;
+    }
+
+    return root;
+}
+
+/* find the best fit in the overflow list, a node at least as large as size has no better descendants */
+static void free_index_search(free_index_node_t *node, uint32_t size, free_index_node_t **best) {
+    for (; node; node = node->next) {
+        if (node->size >= size) {
+            if (*best == NULL || free_index_less(node, *best)) {
+                *best = node;
+            }
+        } else {
+            free_index_search(node->child, size, best);
+        }
+    }
+}
+
+/* find the lowest addressed node of a list that is large enough, the heap order says nothing about addresses */
+static void free_index_search_lowest(free_index_node_t *node, uint32_t size, free_index_node_t **best) {
+    for (; node; node = node->next) {
+        if (node->size >= size && (*best == NULL || node->addr < (*best)->addr)) {
+            *best = node;
+        }
+        free_index_search_lowest(node->child, size, best);
+    }
+}
+
+void free_index_init(free_index_t *index) {
+    memset(index, 0, sizeof(free_index_t));
+}
+
+void free_index_insert(free_index_t *index, free_index_node_t *node, uint32_t size, uintptr_t addr) {
+    uint32_t class = free_index_class(size);
+
+    assert(size > 0);
+
+    node->size = size;
+    node->addr = addr;
+    node->child = node->next = node->prev = NULL;
+
+    if (index->lists[class] == NULL) {
+        index->lists[class] = node;
+        index->bitmap[class / 64] |= 1ul << (class % 64);
+        index->summary |= 1ul << (class / 64);
+    } else {
+        index->lists[class] = free_index_meld(index->lists[class], node);
+    }
+}
+
+void free_index_remove(free_index_t *index, free_index_node_t *node) {
+    uint32_t class = free_index_class(node->size);
+    free_index_node_t *subtree = NULL;
+
+    if (index->lists[class] == node) {
+        index->lists[class] = free_index_merge_pairs(node->child);
+    } else {
+        /* cut the node out of its sibling list and meld its children back into the heap */
+        if (node->prev->child == node) {
+            node->prev->child = node->next;
+        } else {
+            node->prev->next = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        }
+        if ((subtree = free_index_merge_pairs(node->child)) != NULL) {
+            index->lists[class] = free_index_meld(index->lists[class], subtree);
+        }
+    }
+    node->child = node->next = node->prev = NULL;
+
+    if (index->lists[class] == NULL) {
+        index->bitmap[class / 64] &= ~(1ul << (class % 64));
+        if (index->bitmap[class / 64] == 0) {
+            index->summary &= ~(1ul << (class / 64));
+        }
+    }
+}
+
+free_index_node_t* free_index_best_fit(free_index_t *index, uint32_t size) {
+    uint32_t class = free_index_class(size), word = class / 64;
+    uint64_t bits = index->bitmap[word] & (~0ul << (class % 64));
+    free_index_node_t *best = NULL;
+
+    if (bits == 0) {
+        /* nothing left in this word, consult the summary for the next non-empty one */
+        bits = word + 1 < FREE_INDEX_WORDS ? index->summary & (~0ul << (word + 1)) : 0;
+        if (bits == 0) {
+            return NULL;
+        }
+        word = __builtin_ctzll(bits);
+        bits = index->bitmap[word];
+    }
+    class = word * 64 + __builtin_ctzll(bits);
+
+    if (class < FREE_INDEX_CLASSES-1 || index->lists[class]->size >= size) {
+        /* exact list or smallest overflow entry, the root is the best fit with the lowest address */
+        return index->lists[class];
+    }
+    free_index_search(index->lists[class], size, &best);
+    return best;
+}
+
+free_index_node_t* free_index_first_fit(free_index_t *index, uint32_t size) {
+    uint32_t class = free_index_class(size), word = class / 64;
+    uint64_t bits = index->bitmap[word] & (~0ul << (class % 64));
+    free_index_node_t *best = NULL;
+
+    /* every list at or above the requested size offers its lowest block at the root */
+    while (1) {
+        for (; bits; bits &= bits - 1) {
+            class = word * 64 + __builtin_ctzll(bits);
+            if (class < FREE_INDEX_CLASSES-1) {
+                if (best == NULL || index->lists[class]->addr < best->addr) {
+                    best = index->lists[class];
+                }
+            } else {
+                free_index_search_lowest(index->lists[class], size, &best);
+            }
+        }
+        if (++word == FREE_INDEX_WORDS) {
+            break;
+        }
+        bits = index->bitmap[word];
+    }
+
+    return best;
+}
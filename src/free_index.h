@@ -0,0 +1,23 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef FREE_INDEX_H_
+#define FREE_INDEX_H_
+
+#include "types.h"
+
+#include <stddef.h>
+
+/* get the struct containing an embedded free_index_node_t */
+#define free_index_entry(ptr, type, member) ((type*) ((char*)(ptr) - offsetof(type, member)))
+
+void free_index_init(free_index_t *index);
+
+void free_index_insert(free_index_t *index, free_index_node_t *node, uint32_t size, uintptr_t addr);
+
+void free_index_remove(free_index_t *index, free_index_node_t *node);
+
+free_index_node_t* free_index_best_fit(free_index_t *index, uint32_t size);
+
+free_index_node_t* free_index_first_fit(free_index_t *index, uint32_t size);
+
+#endif /* FREE_INDEX_H_ */
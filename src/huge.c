@@ -0,0 +1,204 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "huge.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "free_index.h"
+#include "slab.h"
+#include "util.h"
+
+extern void *nvm_start;
+extern uint64_t current_version;
+
+/* free extents indexed by size, and by the chunk index of their first and last chunk for coalescing */
+static free_index_t free_chunks;
+static huge_t **extent_map = NULL;
+static uint64_t extent_map_size = 0;
+static slab_cache_t huge_cache;
+static pthread_mutex_t huge_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t huge_chunk_index(nvm_huge_header_t *nvm_huge) {
+    return __NVM_ABS_TO_REL(nvm_huge) / CHUNK_SIZE;
+}
+
+static inline nvm_huge_header_t* huge_header_at(uint64_t idx) {
+    return (nvm_huge_header_t*) __NVM_REL_TO_ABS(idx * CHUNK_SIZE);
+}
+
+/* enter a free extent into the index and the extent map, huge lock must be held */
+static void huge_list(huge_t *huge) {
+    uint64_t idx = huge_chunk_index(huge->nvm_chunk);
+
+    free_index_insert(&free_chunks, &huge->link, huge->n_chunks, (uintptr_t)huge->nvm_chunk);
+    extent_map[idx] = huge;
+    extent_map[idx + huge->n_chunks - 1] = huge;
+}
+
+/* remove a free extent from the index and the extent map, huge lock must be held */
+static void huge_unlist(huge_t *huge) {
+    uint64_t idx = huge_chunk_index(huge->nvm_chunk);
+
+    free_index_remove(&free_chunks, &huge->link);
+    extent_map[idx] = NULL;
+    extent_map[idx + huge->n_chunks - 1] = NULL;
+}
+
+/* find a free extent of at least n_chunks chunks according to the configured policy, huge lock must be held */
+static huge_t* huge_fit(uint32_t n_chunks) {
+    free_index_node_t *node = NULL;
+
+#ifdef HUGE_FIRST_FIT
+    node = free_index_first_fit(&free_chunks, n_chunks);
+#else
+    node = free_index_best_fit(&free_chunks, n_chunks);
+#endif
+    return node ? free_index_entry(node, huge_t, link) : NULL;
+}
+
+/* merge a free extent with its listed neighbours and list the result, huge lock must be held.
+   the merged extent only becomes visible to recovery once the surviving header's n_chunks
+   is persisted, until then the absorbed headers still describe valid free extents */
+static void huge_coalesce_and_list(huge_t *huge) {
+    uint64_t idx = huge_chunk_index(huge->nvm_chunk);
+    huge_t *neighbour = NULL;
+
+    /* absorb the extent directly behind */
+    if (idx + huge->n_chunks < extent_map_size) {
+        neighbour = extent_map[idx + huge->n_chunks];
+        if (neighbour && neighbour->nvm_chunk == huge_header_at(idx + huge->n_chunks)) {
+            huge_unlist(neighbour);
+            huge->nvm_chunk->n_chunks = huge->n_chunks + neighbour->n_chunks;
+            PERSIST(huge->nvm_chunk);
+            huge->n_chunks += neighbour->n_chunks;
+            slab_free(&huge_cache, neighbour);
+        }
+    }
+
+    /* let the extent directly in front absorb this one */
+    if (idx > 0) {
+        neighbour = extent_map[idx - 1];
+        if (neighbour && huge_chunk_index(neighbour->nvm_chunk) + neighbour->n_chunks == idx) {
+            huge_unlist(neighbour);
+            neighbour->nvm_chunk->n_chunks = neighbour->n_chunks + huge->n_chunks;
+            PERSIST(neighbour->nvm_chunk);
+            neighbour->n_chunks += huge->n_chunks;
+            slab_free(&huge_cache, huge);
+            huge = neighbour;
+        }
+    }
+
+    huge_list(huge);
+}
+
+/* stamp a free header with the current version and list it, huge lock must be held */
+static void huge_add_free_locked(nvm_huge_header_t *nvm_huge) {
+    huge_t *huge = (huge_t*) slab_alloc(&huge_cache);
+
+    huge->nvm_chunk = nvm_huge;
+    huge->n_chunks = nvm_huge->n_chunks;
+
+    /* listed extents are skipped by the recovery thread */
+    if (nvm_huge->version != current_version) {
+        nvm_huge->version = current_version;
+        PERSIST(nvm_huge);
+    }
+
+    huge_coalesce_and_list(huge);
+}
+
+void huge_init(uint64_t max_chunks) {
+    free_index_init(&free_chunks);
+    slab_init(&huge_cache, sizeof(huge_t));
+    extent_map_size = max_chunks;
+    extent_map = (huge_t**) calloc(max_chunks, sizeof(huge_t*));
+}
+
+nvm_huge_header_t* huge_reserve(uint64_t n_chunks) {
+    nvm_huge_header_t *nvm_huge = NULL, *nvm_rest = NULL;
+    huge_t *huge = NULL;
+
+    /* the lock only covers the index lookup, splitting and file growth happen outside of it */
+    pthread_mutex_lock(&huge_mtx);
+    if ((huge = huge_fit(n_chunks)) != NULL) {
+        huge_unlist(huge);
+    }
+    pthread_mutex_unlock(&huge_mtx);
+
+    if (huge == NULL) {
+        /* create new chunks for the request */
+        nvm_huge = activate_more_chunks(n_chunks);
+        nvm_huge->state = USAGE_HUGE | STATE_INITIALIZING;
+        nvm_huge->n_chunks = n_chunks;
+        memset(nvm_huge->on, 0, sizeof(nvm_huge->on));
+        nvm_huge->version = current_version;
+        PERSIST(nvm_huge);
+        return nvm_huge;
+    }
+
+    nvm_huge = huge->nvm_chunk;
+    if (huge->n_chunks > n_chunks) {
+        /* carve from the head so that low addresses are reused first, the remainder header
+           must be persistent before the head shrinks */
+        nvm_rest = (nvm_huge_header_t*) ((uintptr_t)nvm_huge + n_chunks*CHUNK_SIZE);
+        nvm_rest->state = USAGE_FREE | STATE_INITIALIZED;
+        nvm_rest->n_chunks = huge->n_chunks - n_chunks;
+        memset(nvm_rest->on, 0, sizeof(nvm_rest->on));
+        nvm_rest->version = current_version;
+        PERSIST(nvm_rest);
+
+        nvm_huge->n_chunks = n_chunks;
+        PERSIST(nvm_huge);
+
+        huge->nvm_chunk = nvm_rest;
+        huge->n_chunks -= n_chunks;
+
+        pthread_mutex_lock(&huge_mtx);
+        huge_coalesce_and_list(huge);
+        pthread_mutex_unlock(&huge_mtx);
+    } else {
+        slab_free(&huge_cache, huge);
+    }
+
+    return nvm_huge;
+}
+
+void huge_add_free(nvm_huge_header_t *nvm_huge) {
+    pthread_mutex_lock(&huge_mtx);
+    huge_add_free_locked(nvm_huge);
+    pthread_mutex_unlock(&huge_mtx);
+}
+
+uint32_t huge_recover(nvm_huge_header_t *nvm_huge) {
+    uint32_t n_chunks = 0;
+
+    pthread_mutex_lock(&huge_mtx);
+    if (nvm_huge->version != current_version) {
+        if (nvm_huge->state == (USAGE_HUGE | STATE_INITIALIZING)) {
+            /* reserved but never activated in a previous run */
+            nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
+            PERSIST(nvm_huge);
+        }
+        if (nvm_huge->state == (USAGE_FREE | STATE_INITIALIZED)) {
+            huge_add_free_locked(nvm_huge);
+        }
+    }
+    /* read under the lock, the extent may be split or merged as soon as it is listed */
+    n_chunks = nvm_huge->n_chunks;
+    pthread_mutex_unlock(&huge_mtx);
+
+    return n_chunks;
+}
+
+void huge_teardown() {
+    /* the descriptors of free extents go away with their slabs */
+    slab_teardown(&huge_cache);
+    free_index_init(&free_chunks);
+    free(extent_map);
+    extent_map = NULL;
+    extent_map_size = 0;
+}
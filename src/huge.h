@@ -0,0 +1,18 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef HUGE_H_
+#define HUGE_H_
+
+#include "types.h"
+
+void huge_init(uint64_t max_chunks);
+
+nvm_huge_header_t* huge_reserve(uint64_t n_chunks);
+
+void huge_add_free(nvm_huge_header_t *nvm_huge);
+
+uint32_t huge_recover(nvm_huge_header_t *nvm_huge);
+
+void huge_teardown();
+
+#endif /* HUGE_H_ */
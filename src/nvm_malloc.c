@@ -5,189 +5,233 @@
 #include <assert.h>
 #include <pthread.h>
 #include <string.h>
-#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "arena.h"
 #include "chunk.h"
+#include "epoch.h"
+#include "flusher.h"
+#include "huge.h"
 #include "object_table.h"
+#include "recovery.h"
+#include "snapshot.h"
+#include "tcache.h"
 #include "util.h"
 
-#include <ulib/hash_chain_prot.h>
 #include <ulib/util_algo.h>
 
 void nvm_initialize_empty();
-void nvm_initialize_recovered(uint64_t n_chunks_recovered);
-void* nvm_recovery_thread();
-nvm_huge_header_t* nvm_reserve_huge(uint64_t n_chunks);
-void log_activate(void *ptr);
-
-/* comparison function for a the free chunk tree - sort by number of chunks */
-int chunk_node_compare(const void *_a, const void *_b) {
-    const huge_t *a = tree_entry(_a, huge_t, link);
-    const huge_t *b = tree_entry(_b, huge_t, link);
-    return generic_compare((uintptr_t)a->n_chunks, (uintptr_t)b->n_chunks);
-}
-
-static huge_t* tree_upper_bound(uint32_t req_chunks, struct tree_root *root) {
-    huge_t *entry;
-    huge_t *last_larger = NULL;
-    while (root) {
-        entry = tree_entry(root, huge_t, link);
-        if (entry->n_chunks == req_chunks) {
-            return entry;
-        } else if (entry->n_chunks < req_chunks){
-            root = root->right;
-        } else {
-            last_larger = entry;
-            root = root->left;
-        }
-    }
-    return last_larger;
-}
+void nvm_initialize_recovered(uint64_t n_chunks_recovered, int clean);
+uintptr_t* log_activate(void *ptr, persist_domain_t *domain);
+void activate_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+void free_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+void release_object(void *ptr);
 
 /* start of mapped NVM space */
 void *nvm_start = NULL;
 
-/* meta information */
+/* meta information: the version, the activation log geometry, the clean shutdown marker and, from the
+   second cache line on, one log segment per arena */
 extern void *meta_info;
 uint64_t current_version = 0;
-uint64_t next_log_entry = 0;
-uint64_t max_log_entries = 127;
+uint64_t log_segment_entries = 0;
 uintptr_t *log_start = (uintptr_t*) NULL;
+nvm_epoch_record_t *epoch_records = (nvm_epoch_record_t*) NULL;
 
-/* global free chunk tree */
-node_t *free_chunks = NULL;
-pthread_mutex_t chunk_mtx = PTHREAD_MUTEX_INITIALIZER;
-
-/* thread -> arena mapping as hash table */
-DEFINE_CHAINHASH(tmap,
-                 pid_t,
-                 arena_t*,
-                 1,
-                 chainhash_hashfn,
-                 chainhash_equalfn,
-                 chainhash_cmpfn);
+/* thread -> arena binding and thread cache, kept in thread-local storage */
 arena_t **arenas=NULL;
 static uint32_t next_arena=0;
-static chainhash_t(tmap) *tidmap = NULL;
+static uint64_t arena_epoch=0; /* bumped on every nvm_initialize, invalidates bindings of a previous run */
+static pthread_mutex_t arena_bind_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t *thread_tcache = NULL;
+static __thread uint64_t thread_arena_epoch = 0;
+
+/* called on thread exit, flushes the thread cache and hands the thread's arena back to the pool */
+static void arena_thread_exit(void *arg) {
+    tcache_t *tcache = (tcache_t*) arg;
+    if (thread_arena_epoch == arena_epoch && nvm_start != NULL) {
+        epoch_end(tcache);
+        tcache_flush(tcache);
+        pthread_mutex_lock(&arena_bind_mtx);
+        tcache->arena->n_threads -= 1;
+        pthread_mutex_unlock(&arena_bind_mtx);
+    }
+    /* otherwise the binding belongs to a previous run and the arena is already gone */
+    tcache_destroy(tcache);
+    thread_tcache = NULL;
+}
+
+static void arena_key_create() {
+    pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+/* bind the calling thread to the arena with the fewest bound threads, arenas
+   released by exited threads are thereby reused before busy ones are shared */
+static tcache_t* arena_bind() {
+    arena_t *arena = NULL;
+    uint32_t i, idx, start;
+
+    if (thread_tcache != NULL) {
+        /* cache of a previous run, its slots are gone with the old mapping */
+        tcache_destroy(thread_tcache);
+    }
+
+    pthread_mutex_lock(&arena_bind_mtx);
+    start = next_arena++;
+    for (i=0; i<INITIAL_ARENAS; ++i) {
+        idx = (start + i) % INITIAL_ARENAS;
+        if (arena == NULL || arenas[idx]->n_threads < arena->n_threads) {
+            arena = arenas[idx];
+        }
+    }
+    arena->n_threads += 1;
+    pthread_mutex_unlock(&arena_bind_mtx);
+
+    thread_tcache = tcache_create(arena);
+    thread_arena_epoch = arena_epoch;
+    pthread_setspecific(arena_key, thread_tcache);
+    return thread_tcache;
+}
+
+static inline tcache_t* thread_tcache_get() {
+    if (thread_arena_epoch != arena_epoch) {
+        return arena_bind();
+    }
+    return thread_tcache;
+}
 
 void* nvm_initialize(const char *workspace_path, int recover_if_possible) {
     uint64_t n_chunks_recovered = 0;
+    int clean = 0;
 
     if (nvm_start != NULL) {
         return nvm_start;
     }
+    persist_init();
     nvm_start = initalize_nvm_space(workspace_path, MAX_NVM_CHUNKS);
+    huge_init(MAX_NVM_CHUNKS);
+    flusher_init();
 
-    tidmap = chainhash_init(tmap, INITIAL_ARENAS);
+    pthread_once(&arena_key_once, arena_key_create);
+    __sync_fetch_and_add(&arena_epoch, 1);
 
     if (!recover_if_possible || (n_chunks_recovered = recover_chunks()) == 0) {
         /* no chunks were recovered, this is a fresh start so initialize */
         nvm_initialize_empty();
-        log_start = (uintptr_t*)meta_info + 1;
-        ot_init(nvm_start);
     } else {
-        /* chunks were recovered, perform cleanup and consistency check */
+        /* chunks were recovered, the marker is cleared right away as a snapshot only describes the heap until it changes */
         current_version = (*(uint64_t*) meta_info)++;
+        clean = ((uint64_t*) meta_info)[3] == current_version;
+        ((uint64_t*) meta_info)[3] = 0;
         PERSIST(meta_info);
-        log_start = (uintptr_t*)meta_info + 1;
-        nvm_initialize_recovered(n_chunks_recovered);
-        ot_init(nvm_start);
-        ot_recover(nvm_start);
+        log_segment_entries = ((uint64_t*) meta_info)[2];
+        log_start = (uintptr_t*) ((uintptr_t)meta_info + CACHE_LINE_SIZE);
+        epoch_records = (nvm_epoch_record_t*) (log_start + ((uint64_t*) meta_info)[1] * log_segment_entries);
+        nvm_initialize_recovered(n_chunks_recovered, clean);
     }
+    /* the ID index is opened as it is, the log has already replayed links into it */
+    ot_init(nvm_start);
 
     return nvm_start;
 }
 
 void* nvm_reserve(uint64_t n_bytes) {
     void *mem = NULL;
-    arena_t *arena = NULL;
-    huge_t *huge = NULL;
-    nvm_huge_header_t *nvm_huge=NULL;
-    pid_t tid;
-    uint64_t n_chunks, next_arena_num;
-
-    if (n_bytes <= SCLASS_LARGE_MAX) {
-        /* determine arena for calling thread */
-        tid = (uint64_t) syscall(SYS_gettid);
-        chainhash_itr_t(tmap) it = chainhash_get(tmap, tidmap, tid);
-        if (chainhash_end(it)) {
-            next_arena_num = __sync_fetch_and_add(&next_arena, 1) % INITIAL_ARENAS;
-            arena = arenas[next_arena_num];
-            it = chainhash_set(tmap, tidmap, tid);
-            chainhash_value(tmap, it) = arena;
-        } else {
-            arena = chainhash_value(tmap, it);
-        }
-
-        /* let thread's arena handle allocation */
-        mem = arena_allocate(arena, n_bytes);
+    tcache_t *tcache = NULL;
+    uint64_t n_chunks;
+
+    if (n_bytes <= SCLASS_SMALL_MAX) {
+        /* small request, served from the calling thread's cache */
+        tcache = thread_tcache_get();
+        mem = tcache_alloc(tcache, arena_size_class(n_bytes));
+    } else if (n_bytes <= SCLASS_LARGE_MAX) {
+        /* large request, let thread's arena handle allocation */
+        tcache = thread_tcache_get();
+        mem = arena_allocate(tcache->arena, n_bytes);
     } else {
-        /* round n_bytes to multiple of chunk size */
-        n_chunks = (n_bytes + sizeof(nvm_huge_header_t) + CHUNK_SIZE) / CHUNK_SIZE;
-
-        pthread_mutex_lock(&chunk_mtx);
-        huge = tree_upper_bound(n_chunks, free_chunks);
-
-        if (huge == NULL) {
-            pthread_mutex_unlock(&chunk_mtx);
-            nvm_huge = nvm_reserve_huge(n_chunks);
-        } else {
-            tree_del(&huge->link, &free_chunks);
-            pthread_mutex_unlock(&chunk_mtx);
-
-            if (huge->n_chunks > n_chunks) {
-                /* got too many chunks, split and insert rest */
-                nvm_huge = (nvm_huge_header_t*) ((uintptr_t)huge->nvm_chunk + (huge->n_chunks - n_chunks)*CHUNK_SIZE);
-                nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
-                nvm_huge->n_chunks = n_chunks;
-                PERSIST(nvm_huge);
+        /* round n_bytes plus header up to a multiple of chunk size */
+        n_chunks = (n_bytes + sizeof(nvm_huge_header_t) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        mem = (void*) (huge_reserve(n_chunks) + 1);
+    }
 
-                huge->nvm_chunk->n_chunks -= n_chunks;
-                huge->n_chunks -= n_chunks;
+    return mem;
+}
 
-                pthread_mutex_lock(&chunk_mtx);
-                tree_add(&huge->link, chunk_node_compare, &free_chunks);
-                pthread_mutex_unlock(&chunk_mtx);
-            } else {
-                nvm_huge = huge->nvm_chunk;
-                free(huge);
+uint64_t nvm_reserve_n(uint64_t n_bytes, uint64_t count, void **out) {
+    tcache_t *tcache = NULL;
+    uint64_t n_reserved = 0;
+    uint32_t binind, n_filled;
+
+    if (n_bytes <= SCLASS_SMALL_MAX) {
+        /* small request, the slots are carved from the bin's runs in batches as large as the request */
+        tcache = thread_tcache_get();
+        binind = arena_size_class(n_bytes);
+        while (n_reserved < count) {
+            n_filled = tcache_alloc_n(tcache, binind, out + n_reserved, count - n_reserved < UINT32_MAX ? count - n_reserved : UINT32_MAX);
+            if (n_filled == 0) {
+                break;
             }
+            n_reserved += n_filled;
+        }
+    } else {
+        /* large and huge requests take a block each anyway */
+        while (n_reserved < count && (out[n_reserved] = nvm_reserve(n_bytes)) != NULL) {
+            ++n_reserved;
         }
-        mem = (void*) (nvm_huge+1);
     }
 
-    return mem;
+    return n_reserved;
 }
 
 void* nvm_reserve_id(const char *id, uint64_t n_bytes) {
+    uint64_t id_len = strlen(id);
     void *mem = NULL;
 
-    /* check that id is not in use yet */
-    if (ot_get(id) != NULL) {
+    /* check that id is valid and not in use yet */
+    if (id_len > MAX_ID_LENGTH || ot_get(id) != NULL) {
         return NULL;
     }
 
-    if ((mem = nvm_reserve(n_bytes)) == NULL) {
+    /* a long ID is kept in front of the object */
+    if ((mem = nvm_reserve(n_bytes + OT_KEY_SPACE(id_len))) == NULL) {
         return NULL;
     }
 
-    ot_insert(id, mem);
+    if (ot_insert(id, mem) != OT_OK) {
+        /* taken concurrently or no room left in the index */
+        release_object(mem);
+        return NULL;
+    }
 
-    return mem;
+    return (void*) ((uintptr_t)mem + OT_KEY_SPACE(id_len));
 }
 
 void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
+    tcache_t *tcache = thread_tcache_get();
+
+    if (tcache->epoch != NULL) {
+        /* buffered mode, the activation becomes persistent with the thread's next nvm_sync */
+        epoch_defer(tcache, ptr, 0, link_ptr1, target1, link_ptr2, target2);
+    } else {
+        activate_object(ptr, link_ptr1, target1, link_ptr2, target2);
+    }
+}
+
+void activate_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
     nvm_huge_header_t *nvm_huge = NULL;
     nvm_block_header_t *nvm_block = NULL;
     nvm_run_header_t *nvm_run = NULL;
     uintptr_t rel_ptr = __NVM_ABS_TO_REL(ptr);
     uint16_t run_idx;
+    persist_domain_t domain;
+    uintptr_t *log_entry = NULL;
 
-    log_activate(ptr);
+    persist_domain_init(&domain);
+    log_entry = log_activate(ptr, &domain);
 
     /* determine whether we are activating a small, large or huge object */
     if (rel_ptr % CHUNK_SIZE == sizeof(nvm_huge_header_t)) {
@@ -203,24 +247,27 @@ void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2,
                 nvm_huge->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
             }
 
-            sfence();
+            /* the log entry must be persistent before the header can ask for a replay */
+            persist_domain_commit(&domain);
             nvm_huge->state = USAGE_HUGE | STATE_ACTIVATING;
-            sfence();
+            persist_domain_add(&domain, nvm_huge);
+            persist_domain_commit(&domain);
 
             *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-            PERSIST(*link_ptr1);
+            persist_domain_add(&domain, link_ptr1);
             if (link_ptr2) {
                 *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                PERSIST(*link_ptr2);
+                persist_domain_add(&domain, link_ptr2);
             }
+            persist_domain_commit(&domain);
         }
 
-        nvm_huge->state = USAGE_HUGE | STATE_INITIALIZED;
-        sfence();
         memset(nvm_huge->on, 0, 2*sizeof(nvm_ptrset_t));
-        PERSIST(nvm_huge);
+        compiler_barrier();
+        nvm_huge->state = USAGE_HUGE | STATE_INITIALIZED;
+        persist_domain_add(&domain, nvm_huge);
     } else {
-        nvm_block = (nvm_block_header_t*) ((uintptr_t)ptr & ~(BLOCK_SIZE-1));
+        nvm_block = (nvm_block_header_t*) block_header_of(ptr);
         if (GET_USAGE(nvm_block->state) == USAGE_FREE) {
             /* large block */
 
@@ -233,26 +280,28 @@ void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2,
                     nvm_block->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
                 }
 
-                sfence();
+                persist_domain_commit(&domain);
                 nvm_block->state = USAGE_BLOCK | STATE_ACTIVATING;
-                sfence();
+                persist_domain_add(&domain, nvm_block);
+                persist_domain_commit(&domain);
 
                 *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-                PERSIST(*link_ptr1);
+                persist_domain_add(&domain, link_ptr1);
                 if (link_ptr2) {
                     *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                    PERSIST(*link_ptr2);
+                    persist_domain_add(&domain, link_ptr2);
                 }
+                persist_domain_commit(&domain);
             }
 
-            nvm_block->state = USAGE_BLOCK | STATE_INITIALIZED;
-            sfence();
             memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
-            PERSIST(nvm_block);
+            compiler_barrier();
+            nvm_block->state = USAGE_BLOCK | STATE_INITIALIZED;
+            persist_domain_add(&domain, nvm_block);
         } else {
             /* small block */
             nvm_run = (nvm_run_header_t*) nvm_block;
-            run_idx = ((uintptr_t)ptr - (uintptr_t)(nvm_run+1)) / nvm_run->n_bytes;
+            run_idx = ((uintptr_t)ptr - NVM_RUN_DATA(nvm_run)) / nvm_run->n_bytes;
 
             /* make sure no concurrent activations are performed on the same run */
             while (!__sync_bool_compare_and_swap(&nvm_run->state, (USAGE_RUN | STATE_INITIALIZED), (USAGE_RUN | STATE_PREACTIVATE))) {}
@@ -260,6 +309,12 @@ void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2,
             /* save the bit to be changed */
             nvm_run->bit_idx = run_idx;
 
+            if (nvm_run->n_bytes <= SCLASS_PACKED_MAX) {
+                /* packed slots share lines with their neighbours, persist the object's line(s) before the
+                   bit can become persistent so that recovery never sets a bit for a line still in the cache */
+                persist_domain_add_range(&domain, ptr, nvm_run->n_bytes);
+            }
+
             /* store link pointers in header */
             if (link_ptr1) {
                 nvm_run->on[0].ptr = __NVM_ABS_TO_REL(link_ptr1);
@@ -269,79 +324,75 @@ void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2,
                     nvm_run->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
                 }
 
-                sfence();
+                persist_domain_commit(&domain);
                 nvm_run->state = USAGE_RUN | STATE_ACTIVATING;
-                sfence();
+                persist_domain_add(&domain, nvm_run);
+                persist_domain_commit(&domain);
 
                 *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-                PERSIST(*link_ptr1);
+                persist_domain_add(&domain, link_ptr1);
                 if (link_ptr2) {
                     *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                    PERSIST(*link_ptr2);
+                    persist_domain_add(&domain, link_ptr2);
                 }
+            } else if (nvm_run->n_bytes <= SCLASS_PACKED_MAX) {
+                persist_domain_commit(&domain);
             }
 
-            /* mark slot as used on NVM */
-            sfence();
-            nvm_run->bitmap[run_idx/8] |= (1<<(run_idx%8));
-            sfence();
-            nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
-            sfence();
+            /* mark slot as used on NVM, together with the links it must be persistent before the header is reset */
+            *NVM_RUN_BITMAP_WORD(nvm_run, run_idx) |= NVM_RUN_BIT(run_idx);
+            persist_domain_add(&domain, NVM_RUN_BITMAP_WORD(nvm_run, run_idx));
+            if (link_ptr1) {
+                persist_domain_commit(&domain);
+            }
+
+            /* the state is written last as it releases the run to concurrent activations and deallocations */
             nvm_run->bit_idx = -1;
             memset(nvm_run->on, 0, 2*sizeof(nvm_ptrset_t));
-            PERSIST(nvm_run);
+            compiler_barrier();
+            nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
+            persist_domain_add(&domain, nvm_run);
         }
     }
-}
-
-void nvm_activate_id(const char *id) {
-    object_table_entry_t *ot_entry = NULL;
-    nvm_object_table_entry_t *nvm_ot_entry = NULL;
-
-    if ((ot_entry = ot_get(id)) == NULL) {
-        return;
+    persist_domain_commit(&domain);
+    if (nvm_block != NULL && nvm_run == NULL) {
+        /* the large block is persistently allocated, scans may skip it from now on */
+        arena_mark_allocated(nvm_block);
     }
-    nvm_ot_entry = ot_entry->nvm_entry;
 
-    /* step 1 - persist id in INITIALIZING state */
-    nvm_ot_entry->state = STATE_NONE;
-    sfence();
-    strncpy(nvm_ot_entry->id, id, MAX_ID_LENGTH);
-    nvm_ot_entry->id[54] = '\0';
-    nvm_ot_entry->ptr = __NVM_ABS_TO_REL(ot_entry->data_ptr);
-    sfence();
-    nvm_ot_entry->state = STATE_INITIALIZING;
-    PERSIST(nvm_ot_entry);
-
-    /* step 2 - activate data normally */
-    nvm_activate(ot_entry->data_ptr, NULL, NULL, NULL, NULL);
+    /* the entry may be reused now, replaying a completed activation is harmless */
+    *log_entry &= ~LOG_IN_FLIGHT;
+}
 
-    /* step 3 - activate NVM object table entry */
-    nvm_ot_entry->state = STATE_INITIALIZED;
-    PERSIST(nvm_ot_entry);
+void nvm_activate_id(const char *id) {
+    /* never deferred, the index entry is set as the activation's link */
+    ot_activate(id);
 }
 
 void* nvm_get_id(const char *id) {
-    object_table_entry_t *ot_entry = NULL;
+    return ot_get(id);
+}
 
-    if ((ot_entry = ot_get(id)) == NULL) {
-        return NULL;
-    }
+void nvm_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
+    tcache_t *tcache = thread_tcache_get();
 
-    return ot_entry->data_ptr;
+    if (tcache->epoch != NULL) {
+        /* buffered mode, the memory is only reused once the thread's next nvm_sync made the free persistent */
+        epoch_defer(tcache, ptr, EPOCH_OP_FREE, link_ptr1, target1, link_ptr2, target2);
+    } else {
+        free_object(ptr, link_ptr1, target1, link_ptr2, target2);
+    }
 }
 
-void nvm_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
+void free_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2) {
     nvm_huge_header_t *nvm_huge = NULL;
-    huge_t *huge = NULL;
     uintptr_t rel_ptr = __NVM_ABS_TO_REL(ptr);
+    persist_domain_t domain;
 
     if (rel_ptr % CHUNK_SIZE == sizeof(nvm_huge_header_t)) {
         /* ptr is 64 bytes into a chunk --> huge block */
         nvm_huge = (nvm_huge_header_t*) (ptr - sizeof(nvm_huge_header_t));
-        huge = (huge_t*) malloc(sizeof(huge_t));
-        huge->nvm_chunk = nvm_huge;
-        huge->n_chunks = nvm_huge->n_chunks;
+        persist_domain_init(&domain);
 
         /* store link pointers in header */
         if (link_ptr1) {
@@ -352,53 +403,160 @@ void nvm_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void
                 nvm_huge->on[1].value = __NVM_ABS_TO_REL_WITH_NULL(target2);
             }
 
-            sfence();
+            compiler_barrier();
             nvm_huge->state = USAGE_HUGE | STATE_FREEING;
-            sfence();
+            persist_domain_add(&domain, nvm_huge);
+            persist_domain_commit(&domain);
 
             *link_ptr1 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target1);
-            PERSIST(*link_ptr1);
+            persist_domain_add(&domain, link_ptr1);
             if (link_ptr2) {
                 *link_ptr2 = (void*) __NVM_ABS_TO_REL_WITH_NULL(target2);
-                PERSIST(*link_ptr2);
+                persist_domain_add(&domain, link_ptr2);
             }
+            persist_domain_commit(&domain);
         }
 
-        nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
-        sfence();
+        /* the current version keeps recovery from listing the extent a second time */
+        nvm_huge->version = current_version;
         memset(nvm_huge->on, 0, 2*sizeof(nvm_ptrset_t));
-        PERSIST(nvm_huge);
+        compiler_barrier();
+        nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
+        persist_domain_add(&domain, nvm_huge);
+        persist_domain_commit(&domain);
 
-        pthread_mutex_lock(&chunk_mtx);
-        tree_add(&huge->link, chunk_node_compare, &free_chunks);
-        pthread_mutex_unlock(&chunk_mtx);
+        huge_add_free(nvm_huge);
     } else {
-        /* otherwise must be a run or block --> let arena handle */
-        arena_free(ptr, link_ptr1, target1, link_ptr2, target2);
+        /* otherwise must be a run or block --> let arena handle, freed slots go to the thread cache */
+        arena_free(thread_tcache_get(), ptr, link_ptr1, target1, link_ptr2, target2);
     }
 }
 
-void nvm_free_id(const char *id) {
-    object_table_entry_t *ot_entry = NULL;
-    nvm_object_table_entry_t *nvm_entry = NULL;
+/* hand back memory that was reserved but never activated, nothing about it has been written to NVM yet */
+void release_object(void *ptr) {
+    nvm_huge_header_t *nvm_huge = NULL;
+    nvm_block_header_t *nvm_block = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+    arena_t *arena = NULL;
 
-    if ((ot_entry = ot_get(id)) == NULL) {
+    if (__NVM_ABS_TO_REL(ptr) % CHUNK_SIZE == sizeof(nvm_huge_header_t)) {
+        /* an extent fresh from the file is still initializing, the current version keeps recovery from listing it again */
+        nvm_huge = (nvm_huge_header_t*) ((uintptr_t)ptr - sizeof(nvm_huge_header_t));
+        nvm_huge->version = current_version;
+        nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
+        PERSIST(nvm_huge);
+        huge_add_free(nvm_huge);
         return;
     }
 
-    nvm_entry = ot_entry->nvm_entry;
-    nvm_entry->state = STATE_FREEING; // TODO: maybe not do this and instead do sanity check on startup?
-    PERSIST(nvm_entry);
+    nvm_block = (nvm_block_header_t*) block_header_of(ptr);
+    if (GET_USAGE(nvm_block->state) == USAGE_RUN) {
+        /* the slot's bit was never set on NVM, it is only reserved in the volatile bitmap */
+        nvm_run = (nvm_run_header_t*) nvm_block;
+        tcache_dalloc(thread_tcache_get(), arena_size_class(nvm_run->n_bytes), ptr);
+    } else {
+        /* a large block stays free on NVM until its activation, so it only has to be listed again */
+        arena = arenas[nvm_block->arena_id];
+        pthread_mutex_lock(&arena->mtx);
+        arena_add_free_block(arena, nvm_block);
+        pthread_mutex_unlock(&arena->mtx);
+    }
+}
+
+/* activate ptr and free old_ptr in one step, link_ptr is set to ptr with the activation. both go through one epoch,
+   so recovery either replays the pair or neither of them */
+int replace_object(void *old_ptr, void *ptr, void **link_ptr) {
+    tcache_t *tcache = thread_tcache_get();
+    int buffered = tcache->epoch != NULL;
 
-    nvm_free(ot_entry->data_ptr, NULL, NULL, NULL, NULL);
+    if (buffered) {
+        /* a full buffer must not split the pair */
+        epoch_sync(tcache);
+    } else {
+        epoch_begin(tcache);
+        if (tcache->epoch == NULL) {
+            return 0;
+        }
+    }
+    epoch_defer(tcache, ptr, 0, link_ptr, ptr, NULL, NULL);
+    epoch_defer(tcache, old_ptr, EPOCH_OP_FREE, NULL, NULL, NULL, NULL);
+    if (buffered) {
+        epoch_sync(tcache);
+    } else {
+        epoch_end(tcache);
+    }
+    return 1;
+}
 
+void nvm_free_id(const char *id) {
+    /* the index entry is cleared as the deallocation's link */
     ot_remove(id);
 }
 
+nvm_id_t nvm_id_open(const char *id) {
+    return ot_open(id);
+}
+
+void* nvm_id_get(nvm_id_t handle) {
+    return ot_handle_get(handle);
+}
+
+int nvm_id_activate(nvm_id_t handle) {
+    /* fails without a pending reservation or when a replacement could not be recorded */
+    return ot_handle_activate(handle) == OT_OK;
+}
+
+void nvm_id_free(nvm_id_t handle) {
+    ot_handle_remove(handle);
+}
+
+void* nvm_id_replace(nvm_id_t handle, uint64_t n_bytes) {
+    return ot_handle_replace(handle, n_bytes);
+}
+
+int64_t nvm_iterate_ids(const char *prefix, nvm_id_callback_t callback, void *arg) {
+    /* an empty prefix matches every ID */
+    return ot_iterate(NULL, NULL, prefix, callback, arg);
+}
+
+int64_t nvm_iterate_id_range(const char *first, const char *last, nvm_id_callback_t callback, void *arg) {
+    return ot_iterate(first, last, NULL, callback, arg);
+}
+
 extern void nvm_persist(const void *ptr, uint64_t n_bytes) {
     PERSIST_RANGE(ptr, n_bytes);
 }
 
+extern void nvm_set_buffered(int enable) {
+    tcache_t *tcache = thread_tcache_get();
+
+    if (enable) {
+        epoch_begin(tcache);
+    } else {
+        epoch_end(tcache);
+    }
+}
+
+extern void nvm_sync() {
+    epoch_sync(thread_tcache_get());
+}
+
+extern uint64_t nvm_persist_async(const void *ptr, uint64_t n_bytes) {
+    return flusher_enqueue(ptr, n_bytes);
+}
+
+extern void nvm_persist_wait(uint64_t ticket) {
+    flusher_wait(ticket);
+}
+
+extern void* nvm_memcpy_persist(void *dst, const void *src, uint64_t n_bytes) {
+    return persist_memcpy(dst, src, n_bytes);
+}
+
+extern void* nvm_memset_persist(void *dst, int c, uint64_t n_bytes) {
+    return persist_memset(dst, c, n_bytes);
+}
+
 void* nvm_abs(void *rel_ptr) {
     assert(nvm_start != NULL);
     return __NVM_REL_TO_ABS_WITH_NULL(rel_ptr);
@@ -417,12 +575,24 @@ void nvm_initialize_empty() {
     nvm_chunk_header_t *chunk_hdr=NULL;
     nvm_block_header_t *block_hdr=NULL;
     arena_t *arena=NULL;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* size the log segments for the activations the arena's threads may have in flight, in whole cache lines */
+    log_segment_entries = (LOG_ENTRIES_PER_CPU * (n_cpus > 0 ? n_cpus : 1) + INITIAL_ARENAS - 1) / INITIAL_ARENAS;
+    if (log_segment_entries < LOG_MIN_ENTRIES) {
+        log_segment_entries = LOG_MIN_ENTRIES;
+    }
+    log_segment_entries = (log_segment_entries + 7) & ~7ul;
 
     /* perform initialization for chunks when not recovering */
-    initialize_chunks();
+    initialize_chunks(CACHE_LINE_SIZE + INITIAL_ARENAS * (log_segment_entries * sizeof(uintptr_t) + sizeof(nvm_epoch_record_t)));
+    ((uint64_t*) meta_info)[1] = INITIAL_ARENAS;
+    ((uint64_t*) meta_info)[2] = log_segment_entries;
     *(uint64_t*) meta_info = 1;
     PERSIST(meta_info);
     current_version = 0;
+    log_start = (uintptr_t*) ((uintptr_t)meta_info + CACHE_LINE_SIZE);
+    epoch_records = (nvm_epoch_record_t*) (log_start + INITIAL_ARENAS * log_segment_entries);
 
     /* allocate chunks for the initial arena setup */
     activate_more_chunks(INITIAL_ARENAS);
@@ -433,14 +603,16 @@ void nvm_initialize_empty() {
         chunk_hdr = (nvm_chunk_header_t*)__NVM_REL_TO_ABS(i*CHUNK_SIZE);
         chunk_hdr->state = STATE_INITIALIZING | USAGE_ARENA;
         strncpy(chunk_hdr->signature, NVM_CHUNK_SIGNATURE, 47);
-        chunk_hdr->next_ot_chunk = i < INITIAL_ARENAS-1 ? (uintptr_t)((i+1)*CHUNK_SIZE) : (uintptr_t)NULL;
-        memset((void*)chunk_hdr->object_table, 0, 4032);
+        memset((void*)chunk_hdr->object_table, 0, sizeof(chunk_hdr->object_table));
         PERSIST_RANGE((void*)chunk_hdr, sizeof(nvm_chunk_header_t));
 
-        /* initialize the chunk content */
-        block_hdr = (nvm_block_header_t*)(chunk_hdr+1);
+        /* initialize the chunk's page map and content */
+        memset((void*)(chunk_hdr+1), 0, sizeof(nvm_page_map_t));
+        ((nvm_page_map_t*) (chunk_hdr+1))->page_info[ARENA_FIRST_PAGE] = PAGE_INFO(USAGE_FREE, 0);
+        PERSIST_RANGE((void*)(chunk_hdr+1), sizeof(nvm_page_map_t));
+        block_hdr = (nvm_block_header_t*)((uintptr_t)chunk_hdr + ARENA_FIRST_PAGE*BLOCK_SIZE);
         block_hdr->state = STATE_INITIALIZING | USAGE_FREE;
-        block_hdr->n_pages = (CHUNK_SIZE - sizeof(nvm_chunk_header_t) - sizeof(nvm_block_header_t)) / BLOCK_SIZE;
+        block_hdr->n_pages = CHUNK_PAGES - ARENA_FIRST_PAGE;
         memset((void*)((uintptr_t)block_hdr + 5), 0, 59);
         PERSIST((void*)block_hdr);
     }
@@ -460,72 +632,7 @@ void nvm_initialize_empty() {
     }
 }
 
-void* nvm_recovery_thread(void *chunk_count) {
-    nvm_chunk_header_t *nvm_chunk = NULL;
-    nvm_huge_header_t *nvm_huge = NULL;
-    nvm_block_header_t *nvm_block = NULL;
-    nvm_run_header_t *nvm_run = NULL;
-    arena_block_t *block = NULL;
-    arena_run_t *run = NULL, *tmp_run = NULL;
-    char usage = 0;
-    uint64_t n_chunks = (uint64_t) chunk_count, i = 0, j = 0;
-
-    while (i < n_chunks) {
-        nvm_chunk = (nvm_chunk_header_t*) (nvm_start + i*CHUNK_SIZE);
-        if (GET_USAGE(nvm_chunk->state) == USAGE_ARENA) {
-            /* only process arena chunks since we're looking for runs */
-            j = 1;
-            while (j < CHUNK_SIZE/BLOCK_SIZE) {
-                nvm_block = (nvm_block_header_t*) ((uintptr_t)nvm_chunk + j*BLOCK_SIZE);
-                usage = GET_USAGE(nvm_block->state);
-                if (usage == USAGE_FREE) {
-                    /* free block, add to arenas fee pageruns tree */
-                    block = arena_create_block_header(nvm_block);
-                    pthread_mutex_lock(&block->arena->mtx);
-                    tree_add(&block->link, block_node_compare, &block->arena->free_pageruns);
-                    pthread_mutex_unlock(&block->arena->mtx);
-                    j += nvm_block->n_pages;
-                } else if (usage == USAGE_RUN) {
-                    /* run, check if version is up-to-date and otherwise create VHeader */
-                    nvm_run = (nvm_run_header_t*) nvm_block;
-                    tmp_run = nvm_run->vdata;
-                    if (nvm_run->version < current_version) {
-                        run = arena_create_run_header(nvm_run);
-                        pthread_mutex_lock(&run->bin->mtx);
-                        /* after locking, make sure nobody else has created a VHeader yet */
-                        if (tmp_run == nvm_run->vdata) {
-                            nvm_run->vdata = run;
-                            sfence(); /* need to guarantee that vdata is set before version */
-                            nvm_run->version = current_version;
-                            PERSIST(nvm_run);
-                        } else {
-                            /* VHeader was just created by a concurrent deallocation */
-                            free(run);
-                        }
-                        pthread_mutex_unlock(&run->bin->mtx);
-                    }
-                    ++j;
-                } else {
-                    /* block in use, skip */
-                    uint64_t oldj = j;
-                    j += nvm_block->n_pages;
-                    if (j == oldj) {
-                    }
-                }
-            }
-            ++i;
-        } else {
-            /* must be a huge allocation then, so skip it */
-            nvm_huge = (nvm_huge_header_t*) nvm_chunk;
-            i += nvm_huge->n_chunks;
-        }
-    }
-
-
-    return NULL;
-}
-
-void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
+void nvm_initialize_recovered(uint64_t n_chunks_recovered, int clean) {
     uint64_t i;
     uintptr_t rel_ptr = 0;
     void *ptr = NULL, **target = NULL;
@@ -533,12 +640,9 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
     nvm_huge_header_t *nvm_huge = NULL;
     nvm_block_header_t *nvm_block = NULL;
     nvm_run_header_t *nvm_run = NULL;
-    huge_t *huge = NULL;
-    arena_block_t *block = NULL;
     arena_run_t *run = NULL;
     char usage = 0;
     char state = 0;
-    pthread_t recovery_thread;
 
     /* create the arenas */
     arenas = (arena_t**) malloc(INITIAL_ARENAS * sizeof(arena_t*));
@@ -548,9 +652,18 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
         arenas[i] = arena;
     }
 
-    /* process the log to identify potentially inconsistent entries */
-    for (i=0; i<max_log_entries; ++i) {
-        rel_ptr = log_start[i];
+    /* after a clean shutdown, the volatile state is reloaded from the snapshot instead of scanning the heap */
+    if (clean && snapshot_load(n_chunks_recovered)) {
+        return;
+    }
+
+    /* finish the epochs that were committed by buffered threads, everything after them is rolled back */
+    epoch_replay(epoch_records, ((uint64_t*) meta_info)[1]);
+
+    /* process the log to identify potentially inconsistent entries, replayed links get the relative
+       values stored in the headers just like nvm_activate and nvm_free write them */
+    for (i=0; i<((uint64_t*) meta_info)[1]*log_segment_entries; ++i) {
+        rel_ptr = log_start[i] & ~LOG_IN_FLIGHT;
         if (rel_ptr == 0)
             continue;
         ptr = __NVM_REL_TO_ABS(rel_ptr);
@@ -568,39 +681,33 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
                 /* committed to freeing, replay */
                 if (nvm_huge->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_huge->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_huge->on[0].value);
+                    *target = (void*) nvm_huge->on[0].value;
                     PERSIST(target);
                     if (nvm_huge->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_huge->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_huge->on[1].value);
+                        *target = (void*) nvm_huge->on[1].value;
                         PERSIST(target);
                     }
                 }
                 memset(nvm_huge->on, 0, 2*sizeof(nvm_ptrset_t));
                 nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
                 PERSIST(nvm_huge);
-                huge = (huge_t*) malloc(sizeof(huge_t));
-                huge->nvm_chunk = nvm_huge;
-                huge->n_chunks = nvm_huge->n_chunks;
-                tree_add(&huge->link, chunk_node_compare, &free_chunks);
+                huge_add_free(nvm_huge);
             } else if (state == STATE_PREACTIVATE) {
                 /* before committed to activation, rollback */
                 memset(nvm_huge->on, 0, 2*sizeof(nvm_ptrset_t));
                 nvm_huge->state = USAGE_FREE | STATE_INITIALIZED;
                 PERSIST(nvm_huge);
-                huge = (huge_t*) malloc(sizeof(huge_t));
-                huge->nvm_chunk = nvm_huge;
-                huge->n_chunks = nvm_huge->n_chunks;
-                tree_add(&huge->link, chunk_node_compare, &free_chunks);
+                huge_add_free(nvm_huge);
             } else if (state == STATE_ACTIVATING) {
                 /* committed to activation, replay */
                 if (nvm_huge->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_huge->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_huge->on[0].value);
+                    *target = (void*) nvm_huge->on[0].value;
                     PERSIST(target);
                     if (nvm_huge->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_huge->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_huge->on[1].value);
+                        *target = (void*) nvm_huge->on[1].value;
                         PERSIST(target);
                     }
                 }
@@ -623,41 +730,33 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
                 /* committed to freeing, replay */
                 if (nvm_block->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_block->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_block->on[0].value);
+                    *target = (void*) nvm_block->on[0].value;
                     PERSIST(target);
                     if (nvm_block->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_block->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_block->on[1].value);
+                        *target = (void*) nvm_block->on[1].value;
                         PERSIST(target);
                     }
                 }
                 memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
                 nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
                 PERSIST(nvm_block);
-                block = (arena_block_t*) malloc(sizeof(arena_block_t));
-                block->nvm_block = nvm_block;
-                block->n_pages = nvm_block->n_pages;
-                block->arena = arenas[nvm_block->arena_id];
-                tree_add(&block->link, block_node_compare, &block->arena->free_pageruns);
+                arena_add_free_block(arenas[nvm_block->arena_id], nvm_block);
             } else if (state == STATE_PREACTIVATE) {
                 /* before committed to activation, rollback */
                 memset(nvm_block->on, 0, 2*sizeof(nvm_ptrset_t));
                 nvm_block->state = USAGE_FREE | STATE_INITIALIZED;
                 PERSIST(nvm_block);
-                block = (arena_block_t*) malloc(sizeof(arena_block_t));
-                block->nvm_block = nvm_block;
-                block->n_pages = nvm_block->n_pages;
-                block->arena = arenas[nvm_block->arena_id];
-                tree_add(&block->link, block_node_compare, &block->arena->free_pageruns);
+                arena_add_free_block(arenas[nvm_block->arena_id], nvm_block);
             } else if (state == STATE_ACTIVATING) {
                 /* committed to activation, replay */
                 if (nvm_block->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_block->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_block->on[0].value);
+                    *target = (void*) nvm_block->on[0].value;
                     PERSIST(target);
                     if (nvm_block->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_block->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_block->on[1].value);
+                        *target = (void*) nvm_block->on[1].value;
                         PERSIST(target);
                     }
                 }
@@ -669,7 +768,7 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
             }
 
         } else if (usage == USAGE_RUN) {
-            nvm_run = (nvm_run_header_t*) ((uintptr_t)ptr & ~(BLOCK_SIZE-1));
+            nvm_run = (nvm_run_header_t*) block_header_of(ptr);
             state = GET_STATE(nvm_run->state);
             if (state == STATE_PREFREE) {
                 /* before committed to freeing, rollback */
@@ -677,40 +776,50 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
                 /* committed to freeing, replay */
                 if (nvm_run->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_run->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_run->on[0].value);
+                    *target = (void*) nvm_run->on[0].value;
                     PERSIST(target);
                     if (nvm_run->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_run->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_run->on[1].value);
+                        *target = (void*) nvm_run->on[1].value;
                         PERSIST(target);
                     }
                 }
-                nvm_run->bitmap[nvm_run->bit_idx/8] &= ~(1 << (nvm_run->bit_idx % 8));
+                /* the bit index is only reset once the bit itself is persistent */
+                if (nvm_run->bit_idx >= 0) {
+                    *NVM_RUN_BITMAP_WORD(nvm_run, nvm_run->bit_idx) &= ~NVM_RUN_BIT(nvm_run->bit_idx);
+                    PERSIST(NVM_RUN_BITMAP_WORD(nvm_run, nvm_run->bit_idx));
+                }
             } else if (state == STATE_PREACTIVATE) {
                 /* before committed to activation, rollback */
             } else if (state == STATE_ACTIVATING) {
                 /* committed to activation, replay */
                 if (nvm_run->on[0].ptr) {
                     target = (void**)__NVM_REL_TO_ABS(nvm_run->on[0].ptr);
-                    *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_run->on[0].value);
+                    *target = (void*) nvm_run->on[0].value;
                     PERSIST(target);
                     if (nvm_run->on[1].ptr) {
                         target = (void**)__NVM_REL_TO_ABS(nvm_run->on[1].ptr);
-                        *target = __NVM_REL_TO_ABS_WITH_NULL(nvm_run->on[1].value);
+                        *target = (void*) nvm_run->on[1].value;
                         PERSIST(target);
                     }
                 }
-                nvm_run->bitmap[nvm_run->bit_idx/8] |= 1 << (nvm_run->bit_idx % 8);
+                /* the bit index is only reset once the bit itself is persistent */
+                if (nvm_run->bit_idx >= 0) {
+                    *NVM_RUN_BITMAP_WORD(nvm_run, nvm_run->bit_idx) |= NVM_RUN_BIT(nvm_run->bit_idx);
+                    PERSIST(NVM_RUN_BITMAP_WORD(nvm_run, nvm_run->bit_idx));
+                }
             } else {
                 assert(state == STATE_INITIALIZED);
             }
-            /* create the VHeader and reset fields either way */
-            run = arena_create_run_header(nvm_run);
-            run->next = run->bin->runs;
-            run->bin->runs = run;
+            /* create the VHeader and reset fields either way, a run with several entries in the log must only get
+               one as each of them would hand out the same free slots */
+            if (nvm_run->version != current_version) {
+                run = arena_create_run_header(nvm_run);
+                arena_bin_add_run(run);
+                nvm_run->version = current_version;
+                nvm_run->vdata = run;
+            }
             memset(nvm_run->on, 0, 2*sizeof(nvm_ptrset_t));
-            nvm_run->version = current_version;
-            nvm_run->vdata = run;
             nvm_run->bit_idx = -1;
             nvm_run->state = USAGE_RUN | STATE_INITIALIZED;
             PERSIST(nvm_run);
@@ -721,48 +830,57 @@ void nvm_initialize_recovered(uint64_t n_chunks_recovered) {
         log_start[i] = (uintptr_t) NULL;
     }
 
-    pthread_create(&recovery_thread, NULL, nvm_recovery_thread, (void*)n_chunks_recovered);
-    pthread_detach(recovery_thread);
+    /* the chunks themselves are recovered on first access or by the background sweeper */
+    recovery_start(n_chunks_recovered);
 }
 
-nvm_huge_header_t* nvm_reserve_huge(uint64_t n_chunks) {
-    nvm_huge_header_t *nvm_huge = NULL;
-
-    /* create new chunks for the request */
-    nvm_huge = activate_more_chunks(n_chunks);
-    nvm_huge->state = USAGE_HUGE | STATE_INITIALIZING;
-    nvm_huge->n_chunks = n_chunks;
-    memset(nvm_huge->on, 0, sizeof(nvm_huge->on));
-    PERSIST(nvm_huge);
+uintptr_t* log_activate(void *ptr, persist_domain_t *domain) {
+    arena_t *arena = thread_tcache_get()->arena;
+    uintptr_t *segment = log_start + arena->id * log_segment_entries, *slot = NULL, entry;
 
-    return nvm_huge;
-}
+    /* claim an entry of the arena's own segment, skipping those whose activation is still in flight */
+    while (1) {
+        slot = segment + __sync_fetch_and_add(&arena->log_next, 1) % log_segment_entries;
+        entry = *slot;
+        if (!(entry & LOG_IN_FLIGHT) && __sync_bool_compare_and_swap(slot, entry, __NVM_ABS_TO_REL(ptr) | LOG_IN_FLIGHT)) {
+            break;
+        }
+    }
+    /* only activations that go through a replayable state need the entry to be persistent first */
+    persist_domain_add(domain, slot);
 
-void log_activate(void *ptr) {
-    uint64_t slot_index = __sync_fetch_and_add(&next_log_entry, 1);
-    uintptr_t *slot = log_start + (slot_index % max_log_entries);
-    *slot = __NVM_ABS_TO_REL(ptr);
-    PERSIST(slot);
+    return slot;
 }
 
 void nvm_teardown() {
     /* WARNING: this method is NOT thread safe! Make sure all nvm_malloc operations
        are finished before calling this method. */
-    huge_t *node = NULL, *tmp = NULL;
     uint8_t i = 0;
 
     if (nvm_start == NULL) {
         return;
     }
 
+    /* the calling thread's epoch is synced, those of other threads are lost */
+    if (thread_tcache != NULL && thread_arena_epoch == arena_epoch) {
+        epoch_end(thread_tcache);
+    }
+
+    /* stop the sweeper and the flushers while the space is still mapped */
+    recovery_teardown();
+    flusher_teardown();
+
+    /* a persistent snapshot of the free memory lets the next start skip the scan, the marker is set last */
+    if (snapshot_write(*(uint64_t*) meta_info)) {
+        ((uint64_t*) meta_info)[3] = *(uint64_t*) meta_info;
+        PERSIST(meta_info);
+    }
+
     /* teardown chunk system */
     teardown_nvm_space();
 
-    /* free all global free chunk headers */
-    tree_for_each_entry_safe(node, tmp, free_chunks, link) {
-        tree_del(&node->link, &free_chunks);
-        free(node);
-    }
+    /* free all free extent headers */
+    huge_teardown();
 
     /* deconstruct all arenas */
     for (i=0; i<INITIAL_ARENAS; ++i) {
@@ -774,13 +892,13 @@ void nvm_teardown() {
     /* deconstruct object table */
     ot_teardown();
 
-    /* destroy thread->arena mapping (no explicit deallocations necessary) */
-    chainhash_destroy(tmap, tidmap);
-    tidmap = NULL;
+    /* thread->arena bindings are invalidated by the epoch on the next nvm_initialize */
+    next_arena = 0;
 
     /* zero some global values */
     nvm_start = NULL;
     current_version = 0;
-    next_log_entry = 0;
+    log_segment_entries = 0;
     log_start = (uintptr_t*) NULL;
+    epoch_records = (nvm_epoch_record_t*) NULL;
 }
@@ -12,10 +12,18 @@ extern "C" {
 #define NVM_ABS_TO_REL(base, ptr) ((uintptr_t)ptr - (uintptr_t)base)
 #define NVM_REL_TO_ABS(base, ptr) (void*)((uintptr_t)base + (uintptr_t)ptr)
 
+/* refers to a named object without its ID, valid until the object is freed */
+typedef struct nvm_object_table_entry_s* nvm_id_t;
+
+/* called for every activated ID of an enumeration, a nonzero return value ends it */
+typedef int (*nvm_id_callback_t)(const char *id, void *ptr, void *arg);
+
 extern void* nvm_initialize(const char *workspace_path, int recover_if_possible);
 
 extern void* nvm_reserve(uint64_t n_bytes);
 
+extern uint64_t nvm_reserve_n(uint64_t n_bytes, uint64_t count, void **out);
+
 extern void* nvm_reserve_id(const char *id, uint64_t n_bytes);
 
 extern void nvm_activate(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
@@ -28,8 +36,34 @@ extern void nvm_free(void *ptr, void **link_ptr1, void *target1, void **link_ptr
 
 extern void nvm_free_id(const char *id);
 
+extern nvm_id_t nvm_id_open(const char *id);
+
+extern void* nvm_id_get(nvm_id_t handle);
+
+extern int nvm_id_activate(nvm_id_t handle);
+
+extern void nvm_id_free(nvm_id_t handle);
+
+extern void* nvm_id_replace(nvm_id_t handle, uint64_t n_bytes);
+
+extern int64_t nvm_iterate_ids(const char *prefix, nvm_id_callback_t callback, void *arg);
+
+extern int64_t nvm_iterate_id_range(const char *first, const char *last, nvm_id_callback_t callback, void *arg);
+
 extern void nvm_persist(const void *ptr, uint64_t n_bytes);
 
+extern void nvm_set_buffered(int enable);
+
+extern void nvm_sync();
+
+extern uint64_t nvm_persist_async(const void *ptr, uint64_t n_bytes);
+
+extern void nvm_persist_wait(uint64_t ticket);
+
+extern void* nvm_memcpy_persist(void *dst, const void *src, uint64_t n_bytes);
+
+extern void* nvm_memset_persist(void *dst, int c, uint64_t n_bytes);
+
 extern void* nvm_abs(void *rel_ptr);
 
 extern void* nvm_rel(void *abs_ptr);
@@ -2,26 +2,42 @@
 
 #include "object_table.h"
 
+#include "nvm_malloc.h"
 #include "util.h"
 
-#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 
-#include <ulib/hash_chain_prot.h>
+extern void *nvm_start;
 
-#define NVM_ABS_TO_REL(base, ptr) ((uintptr_t)ptr - (uintptr_t)base)
-#define NVM_REL_TO_ABS(base, ptr) (void*)((uintptr_t)base + (uintptr_t)ptr)
+void activate_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+void free_object(void *ptr, void **link_ptr1, void *target1, void **link_ptr2, void *target2);
+void release_object(void *ptr);
+int replace_object(void *old_ptr, void *ptr, void **link_ptr);
 
-/* free slot fifo queue to store freed positions */
-#define SLOT_BUFFER_SIZE 200
-static uint64_t slot_buffer[SLOT_BUFFER_SIZE];
-static int64_t slot_buffer_next_idx = 0;
-static int64_t slot_buffer_head_idx = 0;
-static int64_t slot_buffer_tail_idx = -1;
-static int16_t slot_buffer_n_free = 0;
+#define OT_BUCKET(level, hash)   ((hash) & ((level)->n_buckets - 1))
+#define OT_ENTRY_USED(level, i)  ((level)->entries[i].ptr != 0 || (level)->reserved[i] != NULL)
+#define OT_ALLOCATION(level, i)  ((level)->entries[i].ptr ? __NVM_REL_TO_ABS((level)->entries[i].ptr) : (level)->reserved[i])
+#define OT_OBJECT(level, i)      ((void*) ((uintptr_t) OT_ALLOCATION(level, i) + OT_KEY_SPACE((level)->entries[i].id_len)))
+#define OT_SORTED_ID(node)       (avl_entry(node, ot_sorted_node_t, link)->id)
 
-/* object table hash map components */
+#define SORTED_NONE     0
+#define SORTED_BUILDING 1
+#define SORTED_READY    2
+
+/* the ID index lives on NVM as it is, the levels are published through n_levels once they are usable */
+static uintptr_t *ot_root = NULL;
+static ot_level_t levels[OT_MAX_LEVELS];
+static volatile uint32_t n_levels = 0;
+static pthread_mutex_t grow_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* ordered view of the activated IDs, only built once somebody enumerates them and kept up to date by the
+   writers from then on. writers change it while holding the ID's buckets, so it is always taken last */
+static struct avl_root *sorted_root = NULL;
+static volatile int sorted_state = SORTED_NONE;
+static pthread_rwlock_t sorted_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t sorted_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 inline uint64_t hash_fn(const char *str) {
     uint64_t hash = 5381;
@@ -29,230 +45,602 @@ inline uint64_t hash_fn(const char *str) {
     while ((c = *str++)) {
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
     }
+    /* short IDs leave the upper bits empty, mix them in as entries are told apart by the whole hash */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdul;
+    hash ^= hash >> 33;
     return hash;
 }
 
-inline int equal_fn(const char *a, const char *b) {
-    return strncmp(a, b, MAX_ID_LENGTH) == 0;
+/* the ID of a used entry, either inline or at the start of its allocation */
+static const char* ot_key(ot_level_t *level, uint64_t i) {
+    if (level->entries[i].id_len <= OT_INLINE_ID_LENGTH) {
+        return level->entries[i].id;
+    }
+    return (const char*) OT_ALLOCATION(level, i);
 }
 
-inline int compare_fn(const char *a, const char *b) {
-    return strncmp(a, b, MAX_ID_LENGTH);
+static int ot_open_level(uint32_t k) {
+    ot_level_t *level = &levels[k];
+
+    level->n_buckets = (uint64_t)OT_LEVEL_BUCKETS << k;
+    level->entries = (nvm_object_table_entry_t*) __NVM_REL_TO_ABS(ot_root[k]);
+    level->seq = (volatile uint32_t*) calloc(level->n_buckets, sizeof(uint32_t));
+    level->reserved = (void**) calloc(level->n_buckets * OT_BUCKET_ENTRIES, sizeof(void*));
+    if (level->seq == NULL || level->reserved == NULL) {
+        free((void*) level->seq);
+        free(level->reserved);
+        return 0;
+    }
+    return 1;
 }
 
-DEFINE_CHAINHASH(ot,                    /*name*/
-                 const char*,           /*keytype*/
-                 object_table_entry_t*, /*valtype*/
-                 1,                     /*ismap*/
-                 hash_fn,               /*hashfn*/
-                 equal_fn,              /*equalfn*/
-                 compare_fn);           /*cmpfn*/
+/* add level k unless somebody else did so in the meantime. the level is linked into the root by its own
+   activation, so after a crash it is either there completely or not at all */
+static int ot_grow(uint32_t k) {
+    uint64_t n_bytes = ((uint64_t)OT_LEVEL_BUCKETS << k) * OT_BUCKET_ENTRIES * sizeof(nvm_object_table_entry_t);
+    void *mem = NULL;
+    int ok = 1;
 
-static chainhash_t(ot) *ot_hashmap = NULL;
-static uint64_t total_slots_available = 0;
-static uint64_t next_nvm_slot = 0;
-static void* first_chunk = NULL;
+    pthread_mutex_lock(&grow_mtx);
+    if (n_levels == k) {
+        if (k == OT_MAX_LEVELS) {
+            ok = 0;
+        } else if (ot_root[k] == 0) {
+            if ((mem = nvm_reserve(n_bytes)) == NULL) {
+                ok = 0;
+            } else {
+                nvm_memset_persist(mem, 0, n_bytes);
+                activate_object(mem, (void**) &ot_root[k], mem, NULL, NULL);
+            }
+        }
+        if (ok && (ok = ot_open_level(k))) {
+            __sync_synchronize();
+            n_levels = k + 1;
+        }
+    }
+    pthread_mutex_unlock(&grow_mtx);
 
-#define HASHMAP_INSERT(key, value) \
-  { chainhash_itr_t(ot) it = chainhash_set(ot, ot_hashmap, key); \
-    assert(!chainhash_end(it)); \
-    chainhash_value(ot, it) = value; }
+    return ok;
+}
+
+static void ot_lock(ot_level_t *level, uint64_t bucket) {
+    uint32_t seq;
 
-void ot_init(void *nvm_start) {
-    ot_hashmap = chainhash_init(ot, 100);
-    first_chunk = nvm_start;
-    nvm_chunk_header_t *chunk_hdr = (nvm_chunk_header_t*) nvm_start;
     while (1) {
-        total_slots_available += 63;
-        if (chunk_hdr->next_ot_chunk == (uintptr_t)NULL) {
-            break;
-        } else{
-            chunk_hdr = (nvm_chunk_header_t*) NVM_REL_TO_ABS(nvm_start, chunk_hdr->next_ot_chunk);
+        seq = level->seq[bucket];
+        if (!(seq & 1) && __sync_bool_compare_and_swap(&level->seq[bucket], seq, seq + 1)) {
+            return;
         }
     }
 }
 
-void ot_recover(void *nvm_start) {
-    int i=0;
-    uint16_t n;
-    uint64_t current_slot = 0;
-    uint64_t last_used_slot = 0;
-    nvm_chunk_header_t *chunk_hdr = (nvm_chunk_header_t*) first_chunk;
-    nvm_object_table_entry_t *nvm_entry = NULL;
-    object_table_entry_t *entry = NULL;
-    nvm_huge_header_t *nvm_huge = NULL;
-    nvm_block_header_t *nvm_block = NULL;
-    nvm_run_header_t *nvm_run = NULL;
-    uint16_t bit_idx = 0;
-    uint8_t bitmap_idx = 0;
-    char bitmask = 0;
-    char state = -1;
-    int keep = 0;
-    void *ptr = NULL;
+static void ot_unlock(ot_level_t *level, uint64_t bucket) {
+    __sync_fetch_and_add(&level->seq[bucket], 1);
+}
 
-    while (1) {
-        for (i=0; i<63; ++i) {
-            keep = 0;
-            nvm_entry = &chunk_hdr->object_table[i];
-            if (nvm_entry->state == STATE_INITIALIZED) {
-                /* entry is marked as initialized, so we can keep it */
-                keep = 1;
-            } else if (nvm_entry->state == STATE_INITIALIZING) {
-                /* crash occurred during activation but after writing the entry, check corresponding header */
-                /* if header is in state PREFREE, ACTIVATING or INITIALIZED, it is/will be recovered and the entry can persist */
-                ptr = (void*) ((uintptr_t)nvm_start + nvm_entry->ptr);
-                state = identify_usage(ptr);
-                if (state == USAGE_HUGE) {
-                    nvm_huge = (nvm_huge_header_t*) ((uintptr_t)ptr - sizeof(nvm_huge_header_t));
-                    if (nvm_huge->state == STATE_PREFREE ||
-                        nvm_huge->state == STATE_ACTIVATING ||
-                        nvm_huge->state == STATE_INITIALIZED) {
-                        keep = 1;
-                    }
-                } else if (state == USAGE_BLOCK) {
-                    nvm_block = (nvm_block_header_t*) ((uintptr_t)ptr - sizeof(nvm_block_header_t));
-                    if (nvm_block->state == STATE_PREFREE ||
-                        nvm_block->state == STATE_ACTIVATING ||
-                        nvm_block->state == STATE_INITIALIZED) {
-                        keep = 1;
-                    }
-                } else if (state == USAGE_RUN) {
-                    /* for runs, we also need to check that the bit index is the correct one */
-                    nvm_run = (nvm_run_header_t*) ((uintptr_t)ptr & ~(BLOCK_SIZE-1));
-                    bit_idx = ((uintptr_t)ptr - (uintptr_t)(nvm_run+1)) / nvm_run->n_bytes;
-                    bitmask = 1 << (bit_idx % 8);
-                    bitmap_idx = bit_idx / 8;
-                    if ((nvm_run->state == STATE_PREFREE && (nvm_run->bitmap[bitmap_idx] & bitmask) != 0) ||
-                        (nvm_run->state == STATE_ACTIVATING && nvm_run->bit_idx == bit_idx) ||
-                        (nvm_run->state == STATE_INITIALIZED && (nvm_run->bitmap[bitmap_idx] & bitmask) != 0)) {
-                        keep = 1;
-                    }
-                }
-                if (keep) {
-                    nvm_entry->state = STATE_INITIALIZED;
-                } else {
-                    memset(nvm_entry, 0, sizeof(nvm_object_table_entry_t));
-                }
-                PERSIST(nvm_entry);
+/* index of the entry holding id in a bucket, activated or reserved, or -1. the caller holds the bucket or validates it.
+   an ID kept out of line is only read if hash and length match */
+static int64_t ot_find(ot_level_t *level, uint64_t bucket, uint64_t hash, const char *id, size_t len) {
+    uint64_t i;
+
+    for (i=bucket*OT_BUCKET_ENTRIES; i<(bucket+1)*OT_BUCKET_ENTRIES; ++i) {
+        if (OT_ENTRY_USED(level, i) && level->entries[i].hash == hash && level->entries[i].id_len == len &&
+            memcmp(ot_key(level, i), id, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* look id up in a bucket without taking it, the lookup is repeated if a writer changed the bucket meanwhile.
+   returns the entry's index and its object in data_ptr */
+static int64_t ot_read(ot_level_t *level, uint64_t bucket, uint64_t hash, const char *id, size_t len, void **data_ptr) {
+    uint32_t seq;
+    int64_t i;
+
+    do {
+        while ((seq = level->seq[bucket]) & 1) {}
+        compiler_barrier();
+        *data_ptr = NULL;
+        if ((i = ot_find(level, bucket, hash, id, len)) >= 0) {
+            *data_ptr = OT_OBJECT(level, i);
+        }
+        compiler_barrier();
+    } while (level->seq[bucket] != seq);
+
+    return i;
+}
+
+/* writers of an ID serialize on its bucket in the first level, which must exist. with that held, find the entry
+   of id and take its bucket as well, returns the entry's level or NULL with only the first bucket held */
+static ot_level_t* ot_acquire(const char *id, size_t len, uint64_t hash, uint64_t *bucket, int64_t *idx) {
+    ot_level_t *level = NULL;
+    uint32_t k, n = n_levels;
+
+    ot_lock(&levels[0], OT_BUCKET(&levels[0], hash));
+    for (k=0; k<n; ++k) {
+        level = &levels[k];
+        *bucket = OT_BUCKET(level, hash);
+        if (k > 0) {
+            ot_lock(level, *bucket);
+        }
+        if ((*idx = ot_find(level, *bucket, hash, id, len)) >= 0) {
+            return level;
+        }
+        if (k > 0) {
+            ot_unlock(level, *bucket);
+        }
+    }
+    return NULL;
+}
+
+static void ot_release(uint64_t hash, ot_level_t *level, uint64_t bucket) {
+    if (level != NULL && level != &levels[0]) {
+        ot_unlock(level, bucket);
+    }
+    ot_unlock(&levels[0], OT_BUCKET(&levels[0], hash));
+}
+
+/* level and index of the entry a handle refers to, entries never move once their level exists */
+static ot_level_t* ot_level_of(nvm_object_table_entry_t *entry, int64_t *idx) {
+    uint32_t k, n = n_levels;
+
+    for (k=0; k<n; ++k) {
+        if (entry >= levels[k].entries && entry < levels[k].entries + levels[k].n_buckets * OT_BUCKET_ENTRIES) {
+            *idx = entry - levels[k].entries;
+            return &levels[k];
+        }
+    }
+    return NULL;
+}
+
+/* like ot_acquire, but for the entry behind a handle. the hash stored in the entry leads to the ID's first bucket,
+   the entry must still be in use once both buckets are held */
+static ot_level_t* ot_acquire_entry(nvm_object_table_entry_t *entry, uint64_t *hash, uint64_t *bucket, int64_t *idx) {
+    ot_level_t *level = NULL;
+
+    if ((level = ot_level_of(entry, idx)) == NULL) {
+        return NULL;
+    }
+    *hash = entry->hash;
+    *bucket = *idx / OT_BUCKET_ENTRIES;
+    ot_lock(&levels[0], OT_BUCKET(&levels[0], *hash));
+    if (level != &levels[0]) {
+        ot_lock(level, *bucket);
+    }
+    if (!OT_ENTRY_USED(level, *idx) || entry->hash != *hash) {
+        ot_release(*hash, level, *bucket);
+        return NULL;
+    }
+    return level;
+}
+
+static int ot_sorted_compare(const void *a, const void *b) {
+    return strcmp(OT_SORTED_ID(a), OT_SORTED_ID(b));
+}
+
+/* first node not ordered before id, or NULL. the caller holds sorted_lock */
+static struct avl_root* ot_sorted_lower_bound(const char *id) {
+    struct avl_root *node = sorted_root, *best = NULL;
+
+    while (node != NULL) {
+        if (strcmp(OT_SORTED_ID(node), id) >= 0) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/* add an activated ID or point it to its new object, the caller holds sorted_lock for writing. IDs seen by both a writer
+   and the build are only added once */
+static int ot_sorted_add(const char *id, void *data_ptr) {
+    ot_sorted_node_t *node = NULL;
+    struct avl_root *existing = NULL;
+    size_t len = strlen(id);
+
+    if ((node = (ot_sorted_node_t*) malloc(sizeof(ot_sorted_node_t) + len + 1)) == NULL) {
+        return 0;
+    }
+    node->data_ptr = data_ptr;
+    memcpy(node->id, id, len + 1);
+    if ((existing = AVL_MAP(&node->link, ot_sorted_compare, &sorted_root)) != &node->link) {
+        /* whoever comes last holds the buckets with the current object */
+        avl_entry(existing, ot_sorted_node_t, link)->data_ptr = data_ptr;
+        free(node);
+    }
+    return 1;
+}
+
+/* children first, an in-order walk would climb through freed parents */
+static void ot_sorted_free(struct avl_root *node) {
+    if (node != NULL) {
+        ot_sorted_free(node->left);
+        ot_sorted_free(node->right);
+        free(avl_entry(node, ot_sorted_node_t, link));
+    }
+}
+
+static void ot_sorted_clear() {
+    ot_sorted_free(sorted_root);
+    sorted_root = NULL;
+}
+
+/* called by writers with the ID's buckets held. without memory for a node the view is dropped and rebuilt on next use */
+static void ot_sorted_update(const char *id, void *data_ptr) {
+    struct avl_root *node = NULL;
+
+    if (sorted_state == SORTED_NONE) {
+        return;
+    }
+    pthread_rwlock_wrlock(&sorted_lock);
+    if (sorted_state != SORTED_NONE) {
+        if (data_ptr != NULL) {
+            if (!ot_sorted_add(id, data_ptr)) {
+                ot_sorted_clear();
+                sorted_state = SORTED_NONE;
             }
+        } else if ((node = ot_sorted_lower_bound(id)) != NULL && strcmp(OT_SORTED_ID(node), id) == 0) {
+            AVL_DEL(node, &sorted_root);
+            free(avl_entry(node, ot_sorted_node_t, link));
+        }
+    }
+    pthread_rwlock_unlock(&sorted_lock);
+}
+
+/* fill the ordered view from the index. writers keep it up to date from the moment it is announced, so each
+   bucket is added while holding it and anything the scan has passed already is their business */
+static int ot_sorted_build() {
+    ot_level_t *level = NULL;
+    uint64_t bucket, i;
+    uint32_t k;
+    int ok = 1;
+
+    pthread_mutex_lock(&sorted_mtx);
+    if (sorted_state != SORTED_READY) {
+        pthread_rwlock_wrlock(&sorted_lock);
+        ot_sorted_clear();
+        sorted_state = SORTED_BUILDING;
+        pthread_rwlock_unlock(&sorted_lock);
 
-            if (keep) {
-                /* if we keep the entry, create its volatile counterpart */
-                entry = malloc(sizeof(object_table_entry_t));
-                memcpy(entry->id, nvm_entry->id, MAX_ID_LENGTH);
-                entry->slot = current_slot;
-                entry->data_ptr = NVM_REL_TO_ABS(first_chunk, nvm_entry->ptr);
-                entry->nvm_entry = nvm_entry;
-                /* add the unused slots we found since the last valid entry to the slot buffer */
-                for (n=last_used_slot+1; n<current_slot; ++n) {
-                    slot_buffer[slot_buffer_next_idx++] = n;
-                    ++slot_buffer_tail_idx;
-                    ++slot_buffer_n_free;
+        for (k=0; ok && k<n_levels; ++k) {
+            level = &levels[k];
+            for (bucket=0; ok && bucket<level->n_buckets; ++bucket) {
+                ot_lock(level, bucket);
+                pthread_rwlock_wrlock(&sorted_lock);
+                for (i=bucket*OT_BUCKET_ENTRIES; ok && i<(bucket+1)*OT_BUCKET_ENTRIES; ++i) {
+                    if (level->entries[i].ptr != 0) {
+                        ok = ot_sorted_add(ot_key(level, i), OT_OBJECT(level, i));
+                    }
                 }
-                last_used_slot = current_slot;
-                HASHMAP_INSERT(entry->id, entry);
+                /* a writer ran out of memory and dropped the view */
+                ok = ok && sorted_state == SORTED_BUILDING;
+                pthread_rwlock_unlock(&sorted_lock);
+                ot_unlock(level, bucket);
             }
-            ++current_slot;
         }
-        if (chunk_hdr->next_ot_chunk) {
-            chunk_hdr = (nvm_chunk_header_t*) NVM_REL_TO_ABS(first_chunk, chunk_hdr->next_ot_chunk);
+
+        pthread_rwlock_wrlock(&sorted_lock);
+        if (ok) {
+            sorted_state = SORTED_READY;
         } else {
-            break;
+            ot_sorted_clear();
+            sorted_state = SORTED_NONE;
         }
+        pthread_rwlock_unlock(&sorted_lock);
     }
+    pthread_mutex_unlock(&sorted_mtx);
 
-    next_nvm_slot = last_used_slot+1;
+    return ok;
 }
 
-int ot_insert(const char *id, void *data_ptr) {
-    uint64_t slot, chunk_for_slot, slot_in_chunk;
-    object_table_entry_t *entry = NULL;
-    nvm_chunk_header_t *chunk_hdr = NULL;
-    nvm_object_table_entry_t *nvm_entry = NULL;
+/* activate the reservation of an entry whose buckets are held. if the ID is activated already, the reservation
+   replaces its object, the new object is activated and the old one freed in one step */
+static int ot_commit(ot_level_t *level, int64_t i) {
+    nvm_object_table_entry_t *entry = &level->entries[i];
+    void *mem = level->reserved[i];
 
-    if (ot_get(id) != NULL) {
+    if (mem == NULL) {
+        return OT_FAIL;
+    }
+    /* the ID must be persistent before the entry can point to the object, which happens as the activation's link */
+    if (entry->id_len > OT_INLINE_ID_LENGTH) {
+        PERSIST_RANGE(mem, entry->id_len + 1);
+    }
+    if (entry->ptr == 0) {
+        PERSIST(entry);
+        activate_object(mem, (void**) &entry->ptr, mem, NULL, NULL);
+    } else if (!replace_object(__NVM_REL_TO_ABS(entry->ptr), mem, (void**) &entry->ptr)) {
+        return OT_FAIL;
+    }
+    level->reserved[i] = NULL;
+    ot_sorted_update(ot_key(level, i), OT_OBJECT(level, i));
+
+    return OT_OK;
+}
+
+/* free the object and the pending reservation of an entry whose buckets are held */
+static void ot_drop(ot_level_t *level, int64_t i) {
+    nvm_object_table_entry_t *entry = &level->entries[i];
+
+    if (entry->ptr) {
+        /* a long ID goes with the allocation, so leave the ordered view first. the entry is cleared as the deallocation's link */
+        ot_sorted_update(ot_key(level, i), NULL);
+        free_object(__NVM_REL_TO_ABS(entry->ptr), (void**) &entry->ptr, NULL, NULL, NULL);
+    }
+    if (level->reserved[i] != NULL) {
+        /* not activated, hand the memory back */
+        release_object(level->reserved[i]);
+        level->reserved[i] = NULL;
+    }
+}
+
+void ot_init(void *nvm_start) {
+    /* only the levels are mapped, nothing is rebuilt */
+    ot_root = ((nvm_chunk_header_t*) nvm_start)->object_table;
+    n_levels = 0;
+    while (n_levels < OT_MAX_LEVELS && ot_root[n_levels] != 0 && ot_open_level(n_levels)) {
+        ++n_levels;
+    }
+}
+
+/* register the reservation mem for id. an ID too long for the entry is copied to the start of mem,
+   which must hold OT_KEY_SPACE of its length in front of the object */
+int ot_insert(const char *id, void *mem) {
+    uint64_t hash = hash_fn(id), bucket;
+    size_t len = strlen(id);
+    ot_level_t *level = NULL;
+    nvm_object_table_entry_t *entry = NULL;
+    uint32_t k;
+    int64_t i;
+
+    if (n_levels == 0 && !ot_grow(0)) {
+        return OT_FAIL;
+    }
+    if (ot_acquire(id, len, hash, &bucket, &i) != NULL) {
+        ot_release(hash, NULL, 0);
         return OT_DUPLICATE;
     }
 
-    /* find and reserve a slot on NVM, check freed slots first */
-    if (__sync_fetch_and_sub(&slot_buffer_n_free, 1) <= 0) {
-        slot_buffer_n_free += 1;
-        if ((slot = __sync_fetch_and_add(&next_nvm_slot, 1)) >= total_slots_available) {
-            /* oops, we ran out of slots... */
-            __sync_fetch_and_sub(&next_nvm_slot, 1);
+    /* take the first unused entry of the ID's buckets, adding a level if they are all in use */
+    for (k=0; ; ++k) {
+        if (k == n_levels && !ot_grow(k)) {
+            ot_release(hash, NULL, 0);
             return OT_FAIL;
         }
-    } else {
-        slot = slot_buffer[__sync_fetch_and_add(&slot_buffer_head_idx, 1)];
-    }
-
-    /* determine NVM location for OT entry */
-    chunk_for_slot = slot / 63;
-    slot_in_chunk = slot % 63;
-    chunk_hdr = (nvm_chunk_header_t*)((uintptr_t)first_chunk + chunk_for_slot*CHUNK_SIZE);
-    nvm_entry = &chunk_hdr->object_table[slot_in_chunk];
-
-    /* create the volatile OT entry */
-    entry = (object_table_entry_t*) malloc(sizeof(object_table_entry_t));
-    strncpy(entry->id, id, MAX_ID_LENGTH);
-    entry->id[MAX_ID_LENGTH] = '\0';
-    entry->slot = slot;
-    entry->data_ptr = data_ptr;
-    entry->nvm_entry = nvm_entry;
-
-    /* insert into the hashmap */
-    HASHMAP_INSERT(entry->id, entry);
-    return OT_OK;
+        level = &levels[k];
+        bucket = OT_BUCKET(level, hash);
+        if (k > 0) {
+            ot_lock(level, bucket);
+        }
+        for (i=bucket*OT_BUCKET_ENTRIES; i<(bucket+1)*OT_BUCKET_ENTRIES; ++i) {
+            if (!OT_ENTRY_USED(level, i)) {
+                /* the entry reaches NVM with its activation, a reservation is lost on restart */
+                entry = &level->entries[i];
+                entry->hash = hash;
+                entry->id_len = len;
+                memcpy(len <= OT_INLINE_ID_LENGTH ? entry->id : (char*) mem, id, len + 1);
+                level->reserved[i] = mem;
+                ot_release(hash, level, bucket);
+                return OT_OK;
+            }
+        }
+        if (k > 0) {
+            ot_unlock(level, bucket);
+        }
+    }
+}
+
+void* ot_get(const char *id) {
+    uint64_t hash = hash_fn(id);
+    size_t len = strlen(id);
+    void *data_ptr = NULL;
+    uint32_t k, n = n_levels;
+
+    for (k=0; k<n && data_ptr == NULL; ++k) {
+        ot_read(&levels[k], OT_BUCKET(&levels[k], hash), hash, id, len, &data_ptr);
+    }
+    return data_ptr;
 }
 
-object_table_entry_t* ot_get(const char *id) {
-    chainhash_itr_t(ot) it = chainhash_get(ot, ot_hashmap, id);
-    if (!chainhash_end(it)) {
-        return chainhash_value(ot, it);
-    } else {
-        return (object_table_entry_t*)NULL;
+int ot_activate(const char *id) {
+    uint64_t hash = hash_fn(id), bucket = 0;
+    ot_level_t *level = NULL;
+    int64_t i;
+    int result = OT_FAIL;
+
+    if (n_levels == 0) {
+        return OT_FAIL;
     }
+    if ((level = ot_acquire(id, strlen(id), hash, &bucket, &i)) != NULL) {
+        result = ot_commit(level, i);
+    }
+    ot_release(hash, level, bucket);
+
+    return result;
 }
 
 int ot_remove(const char *id) {
-    object_table_entry_t *entry;
-    uint64_t free_slot_idx;
-    chainhash_itr_t(ot) it = chainhash_get(ot, ot_hashmap, id);
-    if (!chainhash_end(it)) {
-        entry = chainhash_value(ot, it);
-        chainhash_del(ot, it);
-        free_slot_idx = __sync_fetch_and_add(&slot_buffer_next_idx, 1) % SLOT_BUFFER_SIZE;
-        slot_buffer[free_slot_idx] = entry->slot;
-        while (!__sync_bool_compare_and_swap(&slot_buffer_tail_idx, free_slot_idx-1, free_slot_idx)) {}
-        slot_buffer_n_free += 1;
-        free((void*)entry);
-        return OT_OK;
-    } else {
+    uint64_t hash = hash_fn(id), bucket = 0;
+    ot_level_t *level = NULL;
+    int64_t i;
+
+    if (n_levels == 0) {
         return OT_FAIL;
     }
+    if ((level = ot_acquire(id, strlen(id), hash, &bucket, &i)) != NULL) {
+        ot_drop(level, i);
+    }
+    ot_release(hash, level, bucket);
+
+    return level != NULL ? OT_OK : OT_FAIL;
 }
 
-void ot_teardown() {
-    chainhash_itr_t(ot) it;
-    object_table_entry_t *value = NULL;
-
-    /* delete object table hashmap */
-    for (it = chainhash_begin(ot, ot_hashmap); !chainhash_end(it); ) {
-        /* no need to free key, just a pointer to the value's id field */
-        value = chainhash_value(ot, it);
-        free(value);
-        if (chainhash_advance(ot, &it))
+nvm_object_table_entry_t* ot_open(const char *id) {
+    uint64_t hash = hash_fn(id);
+    size_t len = strlen(id);
+    void *data_ptr = NULL;
+    uint32_t k, n = n_levels;
+    int64_t i;
+
+    for (k=0; k<n; ++k) {
+        if ((i = ot_read(&levels[k], OT_BUCKET(&levels[k], hash), hash, id, len, &data_ptr)) >= 0) {
+            return &levels[k].entries[i];
+        }
+    }
+    return NULL;
+}
+
+void* ot_handle_get(nvm_object_table_entry_t *entry) {
+    ot_level_t *level = NULL;
+    void *data_ptr = NULL;
+    uint64_t bucket;
+    uint32_t seq;
+    int64_t i;
+
+    if ((level = ot_level_of(entry, &i)) == NULL) {
+        return NULL;
+    }
+    bucket = i / OT_BUCKET_ENTRIES;
+    do {
+        while ((seq = level->seq[bucket]) & 1) {}
+        compiler_barrier();
+        data_ptr = OT_ENTRY_USED(level, i) ? OT_OBJECT(level, i) : NULL;
+        compiler_barrier();
+    } while (level->seq[bucket] != seq);
+
+    return data_ptr;
+}
+
+int ot_handle_activate(nvm_object_table_entry_t *entry) {
+    ot_level_t *level = NULL;
+    uint64_t hash, bucket;
+    int64_t i;
+    int result = OT_FAIL;
+
+    if ((level = ot_acquire_entry(entry, &hash, &bucket, &i)) != NULL) {
+        result = ot_commit(level, i);
+        ot_release(hash, level, bucket);
+    }
+    return result;
+}
+
+int ot_handle_remove(nvm_object_table_entry_t *entry) {
+    ot_level_t *level = NULL;
+    uint64_t hash, bucket;
+    int64_t i;
+
+    if ((level = ot_acquire_entry(entry, &hash, &bucket, &i)) == NULL) {
+        return OT_FAIL;
+    }
+    ot_drop(level, i);
+    ot_release(hash, level, bucket);
+
+    return OT_OK;
+}
+
+/* reserve the next object of an activated ID, it replaces the current one once the handle is activated */
+void* ot_handle_replace(nvm_object_table_entry_t *entry, uint64_t n_bytes) {
+    ot_level_t *level = NULL;
+    uint64_t hash, bucket, len = entry->id_len;
+    void *mem = NULL;
+    int64_t i;
+    int ok = 0;
+
+    if ((mem = nvm_reserve(n_bytes + OT_KEY_SPACE(len))) == NULL) {
+        return NULL;
+    }
+    if ((level = ot_acquire_entry(entry, &hash, &bucket, &i)) != NULL) {
+        /* only one replacement may be pending, and the ID must not have changed while reserving */
+        if (entry->ptr != 0 && level->reserved[i] == NULL && entry->id_len == len) {
+            if (len > OT_INLINE_ID_LENGTH) {
+                memcpy(mem, ot_key(level, i), len + 1);
+            }
+            level->reserved[i] = mem;
+            ok = 1;
+        }
+        ot_release(hash, level, bucket);
+    }
+    if (!ok) {
+        /* the reservation was never activated, a large block would be lost to the free protocol */
+        release_object(mem);
+        return NULL;
+    }
+    return (void*) ((uintptr_t)mem + OT_KEY_SPACE(len));
+}
+
+/* visit the activated IDs in [first, last) or starting with prefix in ascending order, a NULL bound is open.
+   the matches are copied out first so that the callback may use the index itself */
+int64_t ot_iterate(const char *first, const char *last, const char *prefix, nvm_id_callback_t callback, void *arg) {
+    struct avl_root *node = NULL;
+    ot_sorted_node_t **matches = NULL, **grown = NULL;
+    uint64_t n_matches = 0, max_matches = 0, i;
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    int64_t n_visited = 0;
+    int ok = 1, stop = 0;
+
+    /* a writer may drop the view between a build and the read lock, so the state is only trusted under the lock */
+    pthread_rwlock_rdlock(&sorted_lock);
+    while (sorted_state != SORTED_READY) {
+        pthread_rwlock_unlock(&sorted_lock);
+        if (!ot_sorted_build()) {
+            return -1;
+        }
+        pthread_rwlock_rdlock(&sorted_lock);
+    }
+    if (prefix != NULL) {
+        first = prefix;
+    }
+    node = first ? ot_sorted_lower_bound(first) : (sorted_root ? (struct avl_root*) TREE_MIN(sorted_root) : NULL);
+    for (; ok && node != NULL; node=(struct avl_root*) TREE_SUCCESSOR(node)) {
+        if ((prefix != NULL && strncmp(OT_SORTED_ID(node), prefix, prefix_len) != 0) ||
+            (last != NULL && strcmp(OT_SORTED_ID(node), last) >= 0)) {
+            break;
+        }
+        if (n_matches == max_matches) {
+            if ((grown = (ot_sorted_node_t**) realloc(matches, 2 * (max_matches + 16) * sizeof(ot_sorted_node_t*))) == NULL) {
+                ok = 0;
+                break;
+            }
+            matches = grown;
+            max_matches = 2 * (max_matches + 16);
+        }
+        if ((matches[n_matches] = (ot_sorted_node_t*) malloc(sizeof(ot_sorted_node_t) + strlen(OT_SORTED_ID(node)) + 1)) == NULL) {
+            ok = 0;
             break;
+        }
+        matches[n_matches]->data_ptr = avl_entry(node, ot_sorted_node_t, link)->data_ptr;
+        strcpy(matches[n_matches]->id, OT_SORTED_ID(node));
+        ++n_matches;
+    }
+    pthread_rwlock_unlock(&sorted_lock);
+
+    /* a nonzero return of the callback ends the iteration */
+    for (i=0; i<n_matches; ++i) {
+        if (ok && !stop) {
+            ++n_visited;
+            stop = callback(matches[i]->id, matches[i]->data_ptr, arg) != 0;
+        }
+        free(matches[i]);
+    }
+    free(matches);
+
+    return ok ? n_visited : -1;
+}
+
+void ot_teardown() {
+    uint32_t k;
+
+    for (k=0; k<n_levels; ++k) {
+        free((void*) levels[k].seq);
+        free(levels[k].reserved);
     }
-    chainhash_destroy(ot, ot_hashmap);
-    ot_hashmap = NULL;
-    total_slots_available = 0;
-    next_nvm_slot = 0;
-    first_chunk = NULL;
-
-    /* cleanup slot buffer */
-    slot_buffer_next_idx = 0;
-    slot_buffer_head_idx = 0;
-    slot_buffer_tail_idx = -1;
-    slot_buffer_n_free = 0;
+    memset(levels, 0, sizeof(levels));
+    n_levels = 0;
+    ot_root = NULL;
+    ot_sorted_clear();
+    sorted_state = SORTED_NONE;
 }
@@ -3,6 +3,7 @@
 #ifndef OBJECT_TABLE_H_
 #define OBJECT_TABLE_H_
 
+#include "nvm_malloc.h"
 #include "types.h"
 
 #define OT_OK        0
@@ -11,14 +12,26 @@
 
 void ot_init(void *nvm_start);
 
-void ot_recover(void *nvm_start);
-
 int ot_insert(const char *id, void *data_ptr);
 
-object_table_entry_t* ot_get(const char *id);
+void* ot_get(const char *id);
+
+int ot_activate(const char *id);
 
 int ot_remove(const char *id);
 
+nvm_object_table_entry_t* ot_open(const char *id);
+
+void* ot_handle_get(nvm_object_table_entry_t *entry);
+
+int ot_handle_activate(nvm_object_table_entry_t *entry);
+
+int ot_handle_remove(nvm_object_table_entry_t *entry);
+
+void* ot_handle_replace(nvm_object_table_entry_t *entry, uint64_t n_bytes);
+
+int64_t ot_iterate(const char *first, const char *last, const char *prefix, nvm_id_callback_t callback, void *arg);
+
 void ot_teardown();
 
 #endif /* OBJECT_TABLE_H_ */
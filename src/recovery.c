@@ -0,0 +1,285 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "recovery.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "huge.h"
+#include "util.h"
+
+extern void *nvm_start;
+extern uint64_t current_version;
+extern arena_t **arenas;
+
+/* recovery state per chunk, chunks that were never pending read as CHUNK_RECOVERED */
+static volatile char *chunk_recovery = NULL;
+
+/* arena chunks left from previous runs, claimed a stride at a time through recovery_next */
+static uint64_t *recovery_chunks = NULL;
+static uint64_t n_recovery_chunks = 0;
+static uint64_t recovery_next = 0;
+static uint64_t n_pending = 0;
+
+static pthread_t sweeper;
+static int sweeper_started = 0;
+static volatile int sweeper_stop = 0;
+
+/* collect a free block found by a scan for its arena, merged once the scanned chunks are done */
+static void recovery_collect(recovery_worker_t *worker, nvm_block_header_t *nvm_block) {
+    uint32_t id = nvm_block->arena_id;
+    nvm_block_header_t **blocks = NULL;
+
+    if (worker->n_blocks[id] == worker->max_blocks[id]) {
+        blocks = (nvm_block_header_t**) realloc(worker->blocks[id], 2 * (worker->max_blocks[id] + 8) * sizeof(nvm_block_header_t*));
+        if (blocks == NULL) {
+            /* out of memory, fall back to adding the block right away */
+            pthread_mutex_lock(&arenas[id]->mtx);
+            arena_add_free_block(arenas[id], nvm_block);
+            pthread_mutex_unlock(&arenas[id]->mtx);
+            return;
+        }
+        worker->blocks[id] = blocks;
+        worker->max_blocks[id] = 2 * (worker->max_blocks[id] + 8);
+    }
+    worker->blocks[id][worker->n_blocks[id]++] = nvm_block;
+}
+
+/* merge the partial free lists, taking each arena's lock once */
+static void recovery_merge(recovery_worker_t *worker) {
+    nvm_block_header_t *nvm_block = NULL;
+    uint32_t id, k;
+
+    for (id=0; id<INITIAL_ARENAS; ++id) {
+        if (worker->n_blocks[id] > 0) {
+            pthread_mutex_lock(&arenas[id]->mtx);
+            for (k=0; k<worker->n_blocks[id]; ++k) {
+                nvm_block = worker->blocks[id][k];
+                if (nvm_block->state == (USAGE_FREE | STATE_INITIALIZED) && nvm_block->version < current_version) {
+                    arena_add_free_block(arenas[id], nvm_block);
+                }
+            }
+            pthread_mutex_unlock(&arenas[id]->mtx);
+            worker->n_blocks[id] = 0;
+        }
+    }
+}
+
+static void recovery_release(recovery_worker_t *worker) {
+    uint32_t id;
+
+    for (id=0; id<INITIAL_ARENAS; ++id) {
+        free(worker->blocks[id]);
+    }
+}
+
+/* scan the page map of one arena chunk, rebuilding run VHeaders and collecting free blocks of previous versions.
+   only the headers of free blocks and runs are read, allocated blocks are skipped through the page map */
+static void recovery_scan_chunk(recovery_worker_t *worker, nvm_chunk_header_t *nvm_chunk) {
+    nvm_page_map_t *page_map = (nvm_page_map_t*) (nvm_chunk+1);
+    nvm_block_header_t *nvm_block = NULL;
+    nvm_run_header_t *nvm_run = NULL;
+    arena_t *arena = NULL;
+    char usage = 0;
+    uint32_t n_pages = 0;
+    uint32_t j = ARENA_FIRST_PAGE;
+
+    while ((j = page_map_next(page_map, j)) < CHUNK_PAGES) {
+        if (PAGE_USAGE(page_map->page_info[j]) == USAGE_BLOCK) {
+            /* persistently allocated, the pages inside are unmarked */
+            ++j;
+            continue;
+        }
+        nvm_block = (nvm_block_header_t*) ((uintptr_t)nvm_chunk + j*BLOCK_SIZE);
+        usage = GET_USAGE(nvm_block->state);
+        if (usage == USAGE_FREE) {
+            if (nvm_block->state == (USAGE_FREE | STATE_INITIALIZED) && nvm_block->version < current_version) {
+                /* free in a previous run, nobody else touches the block until it is listed */
+                if ((n_pages = nvm_block->n_pages) > 0) {
+                    recovery_collect(worker, nvm_block);
+                }
+            } else {
+                /* already tracked by this session, its size may change while the arena is in use */
+                arena = arenas[nvm_block->arena_id];
+                pthread_mutex_lock(&arena->mtx);
+                n_pages = nvm_block->n_pages;
+                pthread_mutex_unlock(&arena->mtx);
+            }
+        } else if (usage == USAGE_RUN) {
+            /* run, check if version is up-to-date and otherwise create VHeader. the chunk is claimed,
+               frees into it wait for the scan, so nobody else can create one concurrently */
+            nvm_run = (nvm_run_header_t*) nvm_block;
+            if (nvm_run->version < current_version) {
+                arena_restore_run(nvm_run);
+            }
+            n_pages = nvm_run->n_pages;
+        } else {
+            /* block in use, skip */
+            n_pages = nvm_block->n_pages;
+        }
+        /* a zeroed or torn header must not stall the scan */
+        j += n_pages > 0 ? n_pages : 1;
+    }
+}
+
+static void recovery_finish(uint64_t idx) {
+    __sync_bool_compare_and_swap(&chunk_recovery[idx], CHUNK_RECOVERING, CHUNK_RECOVERED);
+    __sync_fetch_and_sub(&n_pending, 1);
+}
+
+/* scan the chunks of a stride that nobody else claimed, they are only published as recovered once their free blocks are listed */
+static void recovery_process(recovery_worker_t *worker, uint64_t first) {
+    uint64_t i, end = first + RECOVERY_STRIDE < n_recovery_chunks ? first + RECOVERY_STRIDE : n_recovery_chunks;
+    uint64_t claimed[RECOVERY_STRIDE];
+    uint32_t n_claimed = 0, k;
+
+    for (i=first; i<end; ++i) {
+        if (__sync_bool_compare_and_swap(&chunk_recovery[recovery_chunks[i]], CHUNK_PENDING, CHUNK_RECOVERING)) {
+            claimed[n_claimed++] = recovery_chunks[i];
+            recovery_scan_chunk(worker, (nvm_chunk_header_t*) (nvm_start + recovery_chunks[i]*CHUNK_SIZE));
+        }
+    }
+    recovery_merge(worker);
+    for (k=0; k<n_claimed; ++k) {
+        recovery_finish(claimed[k]);
+    }
+}
+
+static void* recovery_worker(void *arg) {
+    recovery_worker_t *worker = (recovery_worker_t*) arg;
+    uint64_t i;
+
+    while (!sweeper_stop && (i = __sync_fetch_and_add(&recovery_next, RECOVERY_STRIDE)) < n_recovery_chunks) {
+        recovery_process(worker, i);
+    }
+    recovery_release(worker);
+
+    return NULL;
+}
+
+/* background sweep over the chunks no allocator access has recovered yet */
+static void* recovery_sweeper(void *arg) {
+    recovery_worker_t coordinator, *workers = NULL;
+    uint64_t i, n_workers, n_started;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* one worker per cpu, but no more than there are strides to claim */
+    n_workers = n_cpus > 0 ? n_cpus : 1;
+    if (n_workers > RECOVERY_MAX_THREADS) {
+        n_workers = RECOVERY_MAX_THREADS;
+    }
+    if (n_workers > (n_recovery_chunks + RECOVERY_STRIDE - 1) / RECOVERY_STRIDE) {
+        n_workers = (n_recovery_chunks + RECOVERY_STRIDE - 1) / RECOVERY_STRIDE;
+    }
+
+    /* the sweeper takes a share of the chunks itself, and all of them if no worker could be started */
+    workers = n_workers > 1 ? (recovery_worker_t*) calloc(n_workers - 1, sizeof(recovery_worker_t)) : NULL;
+    for (i=0; workers != NULL && i<n_workers-1; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, recovery_worker, &workers[i]) != 0) {
+            break;
+        }
+    }
+    n_started = i;
+    memset(&coordinator, 0, sizeof(recovery_worker_t));
+    recovery_worker(&coordinator);
+    for (i=0; i<n_started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+
+    return NULL;
+}
+
+void recovery_start(uint64_t n_chunks) {
+    nvm_chunk_header_t *nvm_chunk = NULL;
+    uint32_t n_huge_chunks = 0;
+    uint64_t i = 0;
+
+    chunk_recovery = (volatile char*) calloc(MAX_NVM_CHUNKS, sizeof(char));
+    recovery_chunks = (uint64_t*) malloc(n_chunks * sizeof(uint64_t));
+    n_recovery_chunks = 0;
+    recovery_next = 0;
+    sweeper_stop = 0;
+
+    /* only the chunk headers are read here, huge extents are reclaimed right away while arena chunks are left pending */
+    while (i < n_chunks) {
+        nvm_chunk = (nvm_chunk_header_t*) (nvm_start + i*CHUNK_SIZE);
+        if (GET_USAGE(nvm_chunk->state) == USAGE_ARENA) {
+            chunk_recovery[i] = CHUNK_PENDING;
+            recovery_chunks[n_recovery_chunks++] = i;
+            ++i;
+        } else {
+            /* must be a huge extent then, reclaim it if it was free in a previous run */
+            n_huge_chunks = huge_recover((nvm_huge_header_t*) nvm_chunk);
+            /* a crash while growing the file may leave a zeroed header behind */
+            i += n_huge_chunks > 0 ? n_huge_chunks : 1;
+        }
+    }
+    n_pending = n_recovery_chunks;
+
+    sweeper_started = pthread_create(&sweeper, NULL, recovery_sweeper, NULL) == 0;
+}
+
+void recovery_ensure(void *ptr) {
+    recovery_worker_t worker;
+    uint64_t idx;
+
+    if (chunk_recovery == NULL || n_pending == 0) {
+        return;
+    }
+    idx = __NVM_ABS_TO_REL(ptr) / CHUNK_SIZE;
+    if (chunk_recovery[idx] == CHUNK_RECOVERED) {
+        return;
+    }
+
+    if (__sync_bool_compare_and_swap(&chunk_recovery[idx], CHUNK_PENDING, CHUNK_RECOVERING)) {
+        /* first access to the chunk, recover it synchronously */
+        memset(&worker, 0, sizeof(recovery_worker_t));
+        recovery_scan_chunk(&worker, (nvm_chunk_header_t*) (nvm_start + idx*CHUNK_SIZE));
+        recovery_merge(&worker);
+        recovery_release(&worker);
+        recovery_finish(idx);
+    } else {
+        /* somebody else is scanning it right now */
+        while (chunk_recovery[idx] != CHUNK_RECOVERED) {
+            sched_yield();
+        }
+    }
+}
+
+int recovery_pending() {
+    return chunk_recovery != NULL && n_pending > 0;
+}
+
+void recovery_assist() {
+    recovery_worker_t worker;
+    uint64_t i;
+
+    if ((i = __sync_fetch_and_add(&recovery_next, RECOVERY_STRIDE)) < n_recovery_chunks) {
+        memset(&worker, 0, sizeof(recovery_worker_t));
+        recovery_process(&worker, i);
+        recovery_release(&worker);
+    } else {
+        /* every stride is taken, wait for the scans still running */
+        sched_yield();
+    }
+}
+
+void recovery_teardown() {
+    if (sweeper_started) {
+        sweeper_stop = 1;
+        pthread_join(sweeper, NULL);
+        sweeper_started = 0;
+    }
+    free((void*) chunk_recovery);
+    chunk_recovery = NULL;
+    free(recovery_chunks);
+    recovery_chunks = NULL;
+    n_recovery_chunks = 0;
+    recovery_next = 0;
+    n_pending = 0;
+}
@@ -0,0 +1,18 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+
+#include "types.h"
+
+void recovery_start(uint64_t n_chunks);
+
+void recovery_ensure(void *ptr);
+
+int recovery_pending();
+
+void recovery_assist();
+
+void recovery_teardown();
+
+#endif /* RECOVERY_H_ */
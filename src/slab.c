@@ -0,0 +1,75 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "slab.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* the first cache line of every slab links it to the previously mapped one */
+static int slab_grow(slab_cache_t *cache) {
+    void *slab = NULL;
+
+    if ((slab = mmap(NULL, SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        return 0;
+    }
+    *(void**)slab = cache->slabs;
+    cache->slabs = slab;
+    cache->next = (uintptr_t)slab + CACHE_LINE_SIZE;
+    cache->end = (uintptr_t)slab + SLAB_SIZE;
+    return 1;
+}
+
+void slab_init(slab_cache_t *cache, uint32_t elem_size) {
+    /* elements never share cache lines */
+    cache->elem_size = (elem_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    cache->free_list = NULL;
+    cache->slabs = NULL;
+    cache->next = cache->end = 0;
+    pthread_mutex_init(&cache->mtx, NULL);
+}
+
+void* slab_alloc(slab_cache_t *cache) {
+    void *elem = NULL;
+
+    pthread_mutex_lock(&cache->mtx);
+    if (cache->free_list) {
+        /* reuse the most recently freed element, its lines are most likely still cached */
+        elem = cache->free_list;
+        cache->free_list = *(void**)elem;
+    } else {
+        /* carve a fresh element, mapping a new slab if the current one is used up */
+        if (cache->next + cache->elem_size > cache->end && !slab_grow(cache)) {
+            pthread_mutex_unlock(&cache->mtx);
+            return NULL;
+        }
+        elem = (void*) cache->next;
+        cache->next += cache->elem_size;
+    }
+    pthread_mutex_unlock(&cache->mtx);
+
+    return elem;
+}
+
+void slab_free(slab_cache_t *cache, void *ptr) {
+    pthread_mutex_lock(&cache->mtx);
+    *(void**)ptr = cache->free_list;
+    cache->free_list = ptr;
+    pthread_mutex_unlock(&cache->mtx);
+}
+
+void slab_teardown(slab_cache_t *cache) {
+    void *slab = NULL;
+
+    /* all elements go away with their slabs */
+    while ((slab = cache->slabs) != NULL) {
+        cache->slabs = *(void**)slab;
+        munmap(slab, SLAB_SIZE);
+    }
+    cache->free_list = NULL;
+    cache->next = cache->end = 0;
+    pthread_mutex_destroy(&cache->mtx);
+}
@@ -0,0 +1,16 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include "types.h"
+
+void slab_init(slab_cache_t *cache, uint32_t elem_size);
+
+void* slab_alloc(slab_cache_t *cache);
+
+void slab_free(slab_cache_t *cache, void *ptr);
+
+void slab_teardown(slab_cache_t *cache);
+
+#endif /* SLAB_H_ */
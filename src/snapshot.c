@@ -0,0 +1,159 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "chunk.h"
+#include "huge.h"
+#include "util.h"
+
+extern void *nvm_start;
+extern uint64_t current_version;
+extern arena_t **arenas;
+
+static int snapshot_add(snapshot_list_t *list, void *header) {
+    uintptr_t *items = NULL;
+
+    if (list->n_items == list->max_items) {
+        if ((items = (uintptr_t*) realloc(list->items, 2 * (list->max_items + 64) * sizeof(uintptr_t))) == NULL) {
+            return 0;
+        }
+        list->items = items;
+        list->max_items = 2 * (list->max_items + 64);
+    }
+    list->items[list->n_items++] = __NVM_ABS_TO_REL(header);
+    return 1;
+}
+
+/* collect the free blocks and runs of an arena chunk, NVM is authoritative here as the volatile lists
+   know neither the slots sitting in thread caches nor reserved blocks that were never activated */
+static int snapshot_walk_chunk(snapshot_list_t *blocks, snapshot_list_t *runs, nvm_chunk_header_t *nvm_chunk) {
+    nvm_page_map_t *page_map = (nvm_page_map_t*) (nvm_chunk+1);
+    nvm_block_header_t *nvm_block = NULL;
+    uint32_t j = ARENA_FIRST_PAGE;
+    char usage = 0;
+
+    while ((j = page_map_next(page_map, j)) < CHUNK_PAGES) {
+        if (PAGE_USAGE(page_map->page_info[j]) == USAGE_BLOCK) {
+            ++j;
+            continue;
+        }
+        nvm_block = (nvm_block_header_t*) ((uintptr_t)nvm_chunk + j*BLOCK_SIZE);
+        usage = GET_USAGE(nvm_block->state);
+        if (usage == USAGE_FREE && nvm_block->state == (USAGE_FREE | STATE_INITIALIZED)) {
+            if (!snapshot_add(blocks, nvm_block)) {
+                return 0;
+            }
+        } else if (usage == USAGE_RUN) {
+            if (!snapshot_add(runs, nvm_block)) {
+                return 0;
+            }
+        }
+        /* a zeroed or torn header must not stall the walk */
+        j += nvm_block->n_pages > 0 ? nvm_block->n_pages : 1;
+    }
+    return 1;
+}
+
+int snapshot_write(uint64_t version) {
+    snapshot_list_t blocks, runs, huge;
+    nvm_snapshot_header_t header, *snapshot = NULL;
+    nvm_chunk_header_t *nvm_chunk = NULL;
+    nvm_huge_header_t *nvm_huge = NULL;
+    uint64_t n_bytes = 0, i = 0;
+    uintptr_t dst;
+    int ok = 1;
+
+    memset(&blocks, 0, sizeof(snapshot_list_t));
+    memset(&runs, 0, sizeof(snapshot_list_t));
+    memset(&huge, 0, sizeof(snapshot_list_t));
+    memset(&header, 0, sizeof(nvm_snapshot_header_t));
+    header.version = version;
+    header.n_chunks = active_chunks();
+
+    /* walk the chunk headers just like recovery does, only without changing anything */
+    while (ok && i < header.n_chunks) {
+        nvm_chunk = (nvm_chunk_header_t*) (nvm_start + i*CHUNK_SIZE);
+        if (GET_USAGE(nvm_chunk->state) == USAGE_ARENA) {
+            ok = snapshot_walk_chunk(&blocks, &runs, nvm_chunk);
+            ++i;
+        } else {
+            /* extents that were reserved but never activated are reclaimed on restart */
+            nvm_huge = (nvm_huge_header_t*) nvm_chunk;
+            if (nvm_huge->state == (USAGE_FREE | STATE_INITIALIZED) || nvm_huge->state == (USAGE_HUGE | STATE_INITIALIZING)) {
+                ok = snapshot_add(&huge, nvm_huge);
+            }
+            i += nvm_huge->n_chunks > 0 ? nvm_huge->n_chunks : 1;
+        }
+    }
+
+    if (ok) {
+        header.n_blocks = blocks.n_items;
+        header.n_runs = runs.n_items;
+        header.n_huge = huge.n_items;
+        n_bytes = sizeof(nvm_snapshot_header_t) + (header.n_blocks + header.n_runs + header.n_huge) * sizeof(uintptr_t);
+
+        /* the caller only marks the shutdown as clean once all of this is persistent */
+        if ((snapshot = (nvm_snapshot_header_t*) create_snapshot(n_bytes)) != NULL) {
+            dst = (uintptr_t) (snapshot + 1);
+            persist_memcpy((void*) dst, blocks.items, header.n_blocks * sizeof(uintptr_t));
+            dst += header.n_blocks * sizeof(uintptr_t);
+            persist_memcpy((void*) dst, runs.items, header.n_runs * sizeof(uintptr_t));
+            dst += header.n_runs * sizeof(uintptr_t);
+            persist_memcpy((void*) dst, huge.items, header.n_huge * sizeof(uintptr_t));
+            persist_memcpy(snapshot, &header, sizeof(nvm_snapshot_header_t));
+            close_snapshot(snapshot, n_bytes);
+        } else {
+            ok = 0;
+        }
+    }
+
+    free(blocks.items);
+    free(runs.items);
+    free(huge.items);
+
+    return ok;
+}
+
+int snapshot_load(uint64_t n_chunks) {
+    nvm_snapshot_header_t *snapshot = NULL;
+    nvm_block_header_t *nvm_block = NULL;
+    uintptr_t *items = NULL;
+    uint64_t n_bytes = 0, i;
+
+    if ((snapshot = (nvm_snapshot_header_t*) open_snapshot(&n_bytes)) == NULL) {
+        return 0;
+    }
+    /* the snapshot must belong to this start and cover the whole heap, otherwise fall back to a full recovery */
+    if (n_bytes < sizeof(nvm_snapshot_header_t) ||
+        snapshot->version != current_version ||
+        snapshot->n_chunks != n_chunks ||
+        n_bytes < sizeof(nvm_snapshot_header_t) + (snapshot->n_blocks + snapshot->n_runs + snapshot->n_huge) * sizeof(uintptr_t)) {
+        close_snapshot(snapshot, n_bytes);
+        return 0;
+    }
+
+    /* free blocks, merged with their neighbours as they are added */
+    items = (uintptr_t*) (snapshot + 1);
+    for (i=0; i<snapshot->n_blocks; ++i) {
+        nvm_block = (nvm_block_header_t*) __NVM_REL_TO_ABS(items[i]);
+        arena_add_free_block(arenas[nvm_block->arena_id], nvm_block);
+    }
+
+    /* runs get their VHeaders from the persistent bitmaps */
+    items += snapshot->n_blocks;
+    for (i=0; i<snapshot->n_runs; ++i) {
+        arena_restore_run((nvm_run_header_t*) __NVM_REL_TO_ABS(items[i]));
+    }
+
+    items += snapshot->n_runs;
+    for (i=0; i<snapshot->n_huge; ++i) {
+        huge_recover((nvm_huge_header_t*) __NVM_REL_TO_ABS(items[i]));
+    }
+
+    close_snapshot(snapshot, n_bytes);
+    return 1;
+}
@@ -0,0 +1,12 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "types.h"
+
+int snapshot_write(uint64_t version);
+
+int snapshot_load(uint64_t n_chunks);
+
+#endif /* SNAPSHOT_H_ */
@@ -0,0 +1,83 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#include "tcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+tcache_t* tcache_create(arena_t *arena) {
+    uint32_t i;
+    tcache_t *tcache = (tcache_t*) malloc(sizeof(tcache_t));
+
+    tcache->arena = arena;
+    tcache->epoch = NULL;
+    tcache->spare_epoch = NULL;
+    for (i=0; i<NUM_ARENA_BINS; ++i) {
+        tcache->bins[i].n_cached = 0;
+    }
+
+    return tcache;
+}
+
+void* tcache_alloc(tcache_t *tcache, uint32_t binind) {
+    tcache_bin_t *tbin = &tcache->bins[binind];
+
+    if (tbin->n_cached == 0) {
+        /* cache is empty, refill with a batch of slots from the arena's bin */
+        tbin->n_cached = arena_fill(tcache->arena, binind, tbin->slots, TCACHE_BATCH);
+        if (tbin->n_cached == 0) {
+            return NULL;
+        }
+    }
+
+    return tbin->slots[--tbin->n_cached];
+}
+
+uint32_t tcache_alloc_n(tcache_t *tcache, uint32_t binind, void **slots, uint32_t n_slots) {
+    tcache_bin_t *tbin = &tcache->bins[binind];
+    uint32_t n_filled = n_slots < tbin->n_cached ? n_slots : tbin->n_cached;
+
+    /* hand out the cached slots first, the rest is claimed from the bin's runs without passing through the cache */
+    tbin->n_cached -= n_filled;
+    memcpy(slots, tbin->slots + tbin->n_cached, n_filled * sizeof(void*));
+    if (n_filled < n_slots) {
+        n_filled += arena_fill(tcache->arena, binind, slots + n_filled, n_slots - n_filled);
+    }
+
+    return n_filled;
+}
+
+void tcache_dalloc(tcache_t *tcache, uint32_t binind, void *ptr) {
+    tcache_bin_t *tbin = &tcache->bins[binind];
+
+    if (tbin->n_cached == TCACHE_SLOTS) {
+        /* cache is full, return the oldest batch of slots to their runs */
+        arena_release(tbin->slots, TCACHE_BATCH);
+        memmove(tbin->slots, tbin->slots + TCACHE_BATCH, (TCACHE_SLOTS - TCACHE_BATCH) * sizeof(void*));
+        tbin->n_cached -= TCACHE_BATCH;
+    }
+
+    tbin->slots[tbin->n_cached++] = ptr;
+}
+
+void tcache_flush(tcache_t *tcache) {
+    uint32_t i;
+    tcache_bin_t *tbin = NULL;
+
+    for (i=0; i<NUM_ARENA_BINS; ++i) {
+        tbin = &tcache->bins[i];
+        if (tbin->n_cached > 0) {
+            arena_release(tbin->slots, tbin->n_cached);
+            tbin->n_cached = 0;
+        }
+    }
+}
+
+void tcache_destroy(tcache_t *tcache) {
+    /* NOTE: cached slots are not returned, call tcache_flush first if the arenas are still alive */
+    free(tcache->epoch);
+    free(tcache->spare_epoch);
+    free(tcache);
+}
@@ -0,0 +1,20 @@
+/* Copyright (c) 2014 Tim Berning */
+
+#ifndef TCACHE_H_
+#define TCACHE_H_
+
+#include "types.h"
+
+tcache_t* tcache_create(arena_t *arena);
+
+void* tcache_alloc(tcache_t *tcache, uint32_t binind);
+
+uint32_t tcache_alloc_n(tcache_t *tcache, uint32_t binind, void **slots, uint32_t n_slots);
+
+void tcache_dalloc(tcache_t *tcache, uint32_t binind, void *ptr);
+
+void tcache_flush(tcache_t *tcache);
+
+void tcache_destroy(tcache_t *tcache);
+
+#endif /* TCACHE_H_ */
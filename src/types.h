@@ -30,15 +30,63 @@
 #define CACHE_LINE_SIZE     64
 #define BLOCK_SIZE          4096
 #define CHUNK_SIZE          (4ul * 1024ul * 1024ul) /* 4mb chunks */
+#define NT_MIN_BYTES        1024 /* below this, copying through the cache and flushing beats non-temporal stores */
+#define CHUNK_PAGES         (CHUNK_SIZE / BLOCK_SIZE)
+#define ARENA_FIRST_PAGE    2 /* arena chunks start with the chunk header and the page map */
 #define NVM_CHUNK_SIGNATURE "***NVM_MALLOC_CHUNK_HEADER_SIGNATURE__/o/__***\0"
-#define MAX_ID_LENGTH       54
-
-#define NUM_ARENA_BINS      31
-#define SCLASS_SMALL_MIN    CACHE_LINE_SIZE      /* minimum allocation size due to cache line flush requirements */
-#define SCLASS_SMALL_MAX    (BLOCK_SIZE/2 - 64)  /* half block - 64B for header */
-#define SCLASS_LARGE_MIN    (BLOCK_SIZE/2)       /* half block */
+#define MAX_ID_LENGTH       255 /* longer IDs are refused */
+
+#define NUM_ARENA_BINS      31                   /* 3 packed classes, 8 classes spaced by 64B up to 512B, then 4 per doubling */
+#define NUM_PACKED_BINS     3
+#define SCLASS_SMALL_MIN    16                   /* minimum allocation size, classes below a cache line share lines */
+#define SCLASS_PACKED_MAX   (CACHE_LINE_SIZE-16) /* largest class whose slots share cache lines with their neighbours */
+#define SCLASS_SMALL_MAX    (4 * BLOCK_SIZE)     /* largest class served from runs */
+#define SCLASS_LARGE_MIN    (SCLASS_SMALL_MAX+1) /* beyond this, page granularity is finer than the class spacing */
 #define SCLASS_LARGE_MAX    (CHUNK_SIZE/2 - 64)  /* half chunk - 64B for header */
 
+#define RUN_MAX_PAGES       16  /* upper bound for the number of pages spanned by a run */
+#define RUN_MIN_SLOTS       16  /* runs grow up to RUN_MAX_PAGES until they hold at least this many slots */
+#define RUN_MAX_WASTE       8   /* ...and waste at most 1/RUN_MAX_WASTE of their size at the tail */
+#define RUN_BITMAP_WORDS    8
+#define RUN_MAX_SLOTS       (64 * RUN_BITMAP_WORDS)
+
+#define FREE_INDEX_CLASSES  1024 /* one list per size in pages or chunks, the last one collects everything larger */
+#define FREE_INDEX_WORDS    (FREE_INDEX_CLASSES / 64)
+
+#define LOG_MIN_ENTRIES     16 /* lower bound for the entries of an arena's activation log segment */
+#define LOG_ENTRIES_PER_CPU 8  /* activations a cpu may have in flight, spread over the arenas' segments */
+#define LOG_IN_FLIGHT       1ul /* set in a log entry until its activation completes, pointers are 16 byte aligned */
+
+#define EPOCH_WORDS         2048 /* entries of an epoch record, an operation takes one plus two per link */
+
+#define OT_MAX_LEVELS       16   /* levels of the ID index, each one holds twice the buckets of the one before */
+#define OT_LEVEL_BUCKETS    1024 /* buckets of the first level */
+#define OT_BUCKET_ENTRIES   8    /* an ID only ever lives in its own bucket of a level, so buckets are never probed past */
+#define OT_INLINE_ID_LENGTH 45   /* IDs up to this length are kept in the index entry, longer ones in front of their object */
+#define OT_KEY_SPACE(len)   ((len) > OT_INLINE_ID_LENGTH ? ((len) + CACHE_LINE_SIZE) & ~(CACHE_LINE_SIZE - 1) : 0)
+#define EPOCH_OP_FREE       1ul  /* marks a deferred deallocation in an operation entry, pointers are 16 byte aligned */
+#define EPOCH_OP_LINKS(op)  (((op) >> 1) & 3) /* number of link pairs following an operation entry */
+#define EPOCH_OP_MASK       7ul
+
+#define PERSIST_DOMAIN_LINES 8 /* distinct lines a persist domain collects before flushing early */
+
+#define FLUSH_QUEUE_SIZE    256 /* asynchronous persist requests a thread may have outstanding */
+#define FLUSHER_MAX_THREADS 4   /* upper bound for the background flushers, one per 8 cpus */
+#define FLUSHER_BATCH       16  /* queues a flusher claims per pass */
+#define FLUSHER_IDLE_US     1000 /* an idle flusher rechecks the queues at least this often */
+
+#define RECOVERY_MAX_THREADS 16 /* upper bound for the recovery workers, one per cpu */
+#define RECOVERY_STRIDE     4  /* arena chunks a recovery worker claims at once */
+
+#define CHUNK_RECOVERED     0  /* chunk is usable, either created in this run or already scanned */
+#define CHUNK_PENDING       1  /* arena chunk left from a previous run that nobody scanned yet */
+#define CHUNK_RECOVERING    2  /* arena chunk currently scanned by one thread */
+
+#define SLAB_SIZE           (64 * 1024) /* volatile descriptors are carved from slabs of this size */
+
+#define TCACHE_SLOTS        32 /* number of slots a thread caches per size class */
+#define TCACHE_BATCH        16 /* number of slots moved between thread cache and bin at once */
+
 
 /* state/usage flags */
 /* ----------------- */
@@ -65,40 +113,72 @@
 #define USAGE_HUGE         ((char)5 << 4)
 
 
+/* the first bitmap word of a run lives in its header, the others in the cache line following it */
+#define NVM_RUN_BITMAP_WORD(nvm_run, idx) ((idx) < 64 ? &(nvm_run)->bitmap : (uint64_t*)((nvm_run)+1) + (idx)/64 - 1)
+#define NVM_RUN_BIT(idx)                  (1ul << ((idx) % 64))
+#define NVM_RUN_DATA(nvm_run)             ((uintptr_t)(nvm_run) + (nvm_run)->hdr_lines * CACHE_LINE_SIZE)
+
+/* page map entries, scans only read the headers of marked pages and skip those marked as allocated blocks.
+   a page is only marked USAGE_BLOCK once its header is persistently allocated and unmarked before it is freed */
+#define PAGE_INFO(usage, binind)          ((uint8_t) ((((usage) >> 4) << 5) | (binind)))
+#define PAGE_USAGE(info)                  ((char) (((info) >> 5) << 4))
+#define PAGE_BIN(info)                    ((info) & 31)
+
+
 /* some typedefs */
 /* ------------- */
 
-typedef struct tree_root node_t;
-
 typedef struct nvm_object_table_entry_s nvm_object_table_entry_t;
 typedef struct nvm_chunk_header_s nvm_chunk_header_t;
+typedef struct nvm_page_map_s nvm_page_map_t;
 typedef struct nvm_ptrset_s nvm_ptrset_t;
 typedef struct nvm_huge_header_s nvm_huge_header_t;
 typedef struct nvm_block_header_s nvm_block_header_t;
 typedef struct nvm_run_header_s nvm_run_header_t;
-
-typedef struct object_table_entry_s object_table_entry_t;
+typedef struct nvm_epoch_record_s nvm_epoch_record_t;
+typedef struct nvm_snapshot_header_s nvm_snapshot_header_t;
+
+typedef struct ot_level_s ot_level_t;
+typedef struct ot_sorted_node_s ot_sorted_node_t;
+typedef struct persist_domain_s persist_domain_t;
+typedef struct slab_cache_s slab_cache_t;
+typedef struct flush_range_s flush_range_t;
+typedef struct flush_queue_s flush_queue_t;
+typedef struct free_index_node_s free_index_node_t;
+typedef struct free_index_s free_index_t;
 typedef struct huge_s huge_t;
 typedef struct arena_run_s arena_run_t;
 typedef struct arena_block_s arena_block_t;
 typedef struct arena_bin_s arena_bin_t;
+typedef struct arena_run_geometry_s arena_run_geometry_t;
 typedef struct arena_s arena_t;
+typedef struct tcache_bin_s tcache_bin_t;
+typedef struct tcache_s tcache_t;
+typedef struct epoch_buffer_s epoch_buffer_t;
+typedef struct recovery_worker_s recovery_worker_t;
+typedef struct snapshot_list_s snapshot_list_t;
 
 
 /* non-volatile structs */
 /* -------------------- */
 
 struct nvm_object_table_entry_s {
-    char state;
-    char id[55];
-    uintptr_t ptr;
+    uint64_t hash;   /* lookups only compare the IDs of entries with a matching hash */
+    uintptr_t ptr;   /* the activated allocation, set and cleared as a link of its activation and deallocation */
+    uint16_t id_len;
+    char id[46];     /* the ID if it fits, otherwise it starts the allocation and the object follows in the next line */
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
 struct nvm_chunk_header_s {
     char state;
     char signature[55];
-    uintptr_t next_ot_chunk;
-    nvm_object_table_entry_t object_table[63];
+    uintptr_t object_table[OT_MAX_LEVELS]; /* the levels of the ID index in the first chunk, 0 until created */
+} __attribute__((aligned(BLOCK_SIZE)));
+
+struct nvm_page_map_s {
+    uint8_t run_offset[CHUNK_PAGES]; /* for pages inside a multi-page run the distance to its header in pages, 0 otherwise */
+    uint16_t free_head[CHUNK_PAGES]; /* for the last page of a free block the page of its header, a hint validated against the header */
+    uint8_t page_info[CHUNK_PAGES];  /* for the first page of a block or run its usage and size class, 0 for pages inside */
 } __attribute__((aligned(BLOCK_SIZE)));
 
 struct nvm_ptrset_s {
@@ -110,7 +190,8 @@ struct nvm_huge_header_s {
     char state;
     uint32_t n_chunks;
     nvm_ptrset_t on[2];
-    char __padding[12];
+    uint32_t version; /* set while the extent is listed as free, recovery skips extents of the current version */
+    char __padding[8];
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
 struct nvm_block_header_s {
@@ -118,58 +199,139 @@ struct nvm_block_header_s {
     uint32_t n_pages;
     nvm_ptrset_t on[2];
     uint32_t arena_id;
-    char __padding[12];
+    uint32_t version;     /* vdata is only valid if version matches the current one */
+    arena_block_t *vdata; /* set while the block is listed in its arena's free pageruns */
+    char __padding[8];
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
 struct nvm_run_header_s {
     char state;
+    uint8_t hdr_lines; /* cache lines in front of the first slot */
     uint16_t n_bytes;
+    uint32_t n_pages;  /* same offset as in nvm_block_header_t */
     arena_run_t *vdata;
     nvm_ptrset_t on[2];
-    char bitmap[8];
+    uint64_t bitmap;
     int16_t bit_idx;
     uint16_t arena_id;
     uint32_t version;
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
+/* one per arena in the meta file after the log segments, a non-zero n_words commits the epoch for replay */
+struct nvm_epoch_record_s {
+    uint64_t n_words;
+    char padding[56];
+    uintptr_t words[EPOCH_WORDS]; /* relative object pointers, each followed by its (link, value) pairs */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+
+/* start of the snapshot file written by nvm_teardown, followed by the relative pointers of the free blocks,
+   the runs and the free or unactivated huge extents */
+struct nvm_snapshot_header_s {
+    uint64_t version;  /* meta version of the start the snapshot is meant for */
+    uint64_t n_chunks; /* chunks in the backing file when it was taken */
+    uint64_t n_blocks;
+    uint64_t n_runs;
+    uint64_t n_huge;
+    char padding[24];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 
 /* volatile structs */
 /* ---------------- */
 
-struct object_table_entry_s {
-    char id[MAX_ID_LENGTH+1];
-    uint64_t slot;
+/* a level of the ID index, the bucket words serialize writers and let lock-free readers detect their changes */
+struct ot_level_s {
+    nvm_object_table_entry_t *entries;
+    uint64_t n_buckets;
+    volatile uint32_t *seq; /* per bucket, odd while a writer holds it */
+    void **reserved;        /* per entry, memory reserved under the entry's ID in this session and not activated yet */
+};
+
+/* an activated ID in the ordered view of the index, keyed by a copy of the ID as entries may be reused */
+struct ot_sorted_node_s {
+    struct avl_root link;
     void *data_ptr;
-    nvm_object_table_entry_t *nvm_entry;
+    char id[];
+};
+
+struct persist_domain_s {
+    uint32_t n_lines;
+    uintptr_t lines[PERSIST_DOMAIN_LINES]; /* distinct dirty lines, flushed once at the next commit */
+};
+
+struct slab_cache_s {
+    uint32_t elem_size;  /* rounded up to whole cache lines */
+    void *free_list;     /* freed elements, linked through their first word */
+    uintptr_t next;      /* next unused element of the newest slab */
+    uintptr_t end;
+    void *slabs;         /* mapped slabs, linked through their first word */
+    pthread_mutex_t mtx;
+};
+
+struct flush_range_s {
+    const void *ptr;
+    uint64_t n_bytes;
+};
+
+struct flush_queue_s {
+    uint64_t tail;                            /* requests published by the owning thread, the last one is its ticket */
+    uint64_t completed __attribute__((aligned(CACHE_LINE_SIZE))); /* requests known to be durable */
+    int busy;                                 /* set while a flusher or the owner drains the queue */
+    int orphaned;                             /* the owner exited, the queue is freed once drained */
+    flush_queue_t *next;
+    flush_range_t ranges[FLUSH_QUEUE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct free_index_node_s {
+    free_index_node_t *child;
+    free_index_node_t *next;
+    free_index_node_t *prev; /* parent for a first child, left sibling otherwise */
+    uint32_t size;
+    uintptr_t addr;
+};
+
+struct free_index_s {
+    uint64_t summary;                               /* bit per non-empty bitmap word */
+    uint64_t bitmap[FREE_INDEX_WORDS];              /* bit per non-empty list */
+    free_index_node_t *lists[FREE_INDEX_CLASSES];   /* address-ordered pairing heaps */
 };
 
 struct huge_s {
-    node_t link; /* necessary to store chunks in trees */
+    free_index_node_t link; /* necessary to store chunks in the free index */
     nvm_huge_header_t *nvm_chunk;
     uint32_t n_chunks;
 };
 
 struct arena_run_s {
-    node_t link; /* necessary to store runs in trees */
     nvm_run_header_t *nvm_run;
     arena_bin_t *bin;
+    uintptr_t data;
     uint16_t elem_size;
-    uint16_t n_free;
     uint16_t n_max;
-    char bitmap[8];
+    uint16_t n_words;
+    uint32_t n_free;                    /* reserved before a bit is claimed, never exceeds the clear bits */
+    uint64_t bitmap[RUN_BITMAP_WORDS];  /* claimed lock-free with atomic bit operations, bits beyond n_max are set */
+    int on_list;                        /* whether the run is linked into its bin's run list, protected by the bin lock */
     arena_run_t *next;
 };
 
+struct arena_run_geometry_s {
+    uint32_t elem_size;
+    uint16_t n_pages;
+    uint16_t n_slots;
+    uint8_t hdr_lines;
+};
+
 struct arena_block_s {
-    node_t link; /* necessary to store blocks in trees */
+    free_index_node_t link; /* necessary to store blocks in the free index */
     nvm_block_header_t *nvm_block;
     uint16_t n_pages;
     arena_t *arena;
 };
 
 struct arena_bin_s {
-    arena_run_t *current_run;
-    uint32_t n_free;
+    arena_run_t *current_run; /* may be read without holding the lock */
     uint16_t n_runs;
     arena_run_t *runs;
     pthread_mutex_t mtx;
@@ -177,16 +339,56 @@ struct arena_bin_s {
 
 struct arena_s {
     uint32_t id;
-    arena_bin_t bins[31];
-    node_t *free_pageruns;
+    uint32_t n_threads; /* number of threads bound to the arena */
+    uint32_t log_next;  /* next entry to try in the arena's activation log segment */
+    pthread_mutex_t epoch_mtx; /* serializes the syncs that go through the arena's epoch record */
+    arena_bin_t bins[NUM_ARENA_BINS];
+    free_index_t free_pageruns;
+    slab_cache_t block_cache; /* arena_block_t descriptors of the arena's free blocks */
+    slab_cache_t run_cache;   /* arena_run_t descriptors of the arena's runs */
     pthread_mutex_t mtx;
 };
 
+struct tcache_bin_s {
+    uint32_t n_cached;
+    void *slots[TCACHE_SLOTS]; /* reserved in the volatile run bitmap, handed out LIFO */
+};
+
+/* activations and deallocations a thread in buffered mode has deferred to its next nvm_sync */
+struct epoch_buffer_s {
+    uint32_t n_words;
+    uintptr_t words[EPOCH_WORDS]; /* the record's entries in program order */
+};
+
+struct tcache_s {
+    arena_t *arena;
+    epoch_buffer_t *epoch; /* only set while the thread is in buffered mode */
+    epoch_buffer_t *spare_epoch; /* kept by epoch_end, so short epochs do not allocate a buffer each time */
+    tcache_bin_t bins[NUM_ARENA_BINS];
+};
+
+/* free blocks a recovery scan found, kept per arena until they are merged into the arenas */
+struct recovery_worker_s {
+    pthread_t thread;
+    nvm_block_header_t **blocks[INITIAL_ARENAS];
+    uint32_t n_blocks[INITIAL_ARENAS];
+    uint32_t max_blocks[INITIAL_ARENAS];
+};
+
+/* headers collected by the walk that builds a snapshot, as relative pointers */
+struct snapshot_list_s {
+    uintptr_t *items;
+    uint64_t n_items;
+    uint64_t max_items;
+};
+
 /* make sure the NVRAM structs are correctly sized */
 _Static_assert(sizeof(nvm_object_table_entry_t) == CACHE_LINE_SIZE, "object table entry size should be 64 bytes");
 _Static_assert(sizeof(nvm_chunk_header_t) == BLOCK_SIZE, "chunk header size should be 4096 bytes");
+_Static_assert(sizeof(nvm_page_map_t) == BLOCK_SIZE, "page map size should be 4096 bytes");
 _Static_assert(sizeof(nvm_huge_header_t) == CACHE_LINE_SIZE, "huge header size should be 64 bytes");
 _Static_assert(sizeof(nvm_block_header_t) == CACHE_LINE_SIZE, "block header size should be 64 bytes");
 _Static_assert(sizeof(nvm_run_header_t) == CACHE_LINE_SIZE, "run header size should be 64 bytes");
+_Static_assert(sizeof(nvm_snapshot_header_t) == CACHE_LINE_SIZE, "snapshot header size should be 64 bytes");
 
 #endif /* TYPES_H_ */
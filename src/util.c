@@ -4,8 +4,16 @@
 
 #include "types.h"
 
+#include <cpuid.h>
+#include <immintrin.h>
+#include <string.h>
+
 extern void *nvm_start;
 
+/* CLFLUSH is available everywhere and used until persist_init has run */
+int persist_mode = PERSIST_CLFLUSH;
+
+
 uint64_t round_up(uint64_t num, uint64_t multiple) {
     uint64_t rest = 0;
     if (multiple == 0)
@@ -16,19 +24,52 @@ uint64_t round_up(uint64_t num, uint64_t multiple) {
     return num + multiple - rest;
 }
 
+void* block_header_of(void *ptr) {
+    /* find the header of the block or run containing ptr, pages inside multi-page runs are resolved through the page map */
+    uintptr_t rel_ptr = (uintptr_t)ptr - (uintptr_t)nvm_start;
+    uintptr_t page = (uintptr_t)ptr & ~(BLOCK_SIZE-1);
+    nvm_page_map_t *page_map = (nvm_page_map_t*) ((uintptr_t)nvm_start + (rel_ptr & ~(CHUNK_SIZE-1)) + BLOCK_SIZE);
+    return (void*) (page - page_map->run_offset[(rel_ptr % CHUNK_SIZE) / BLOCK_SIZE] * BLOCK_SIZE);
+}
+
+uint32_t page_map_next(const nvm_page_map_t *page_map, uint32_t page_idx) {
+    /* find the first marked page at or after page_idx, sixteen entries are tested at once */
+    uint32_t mask;
+
+    for (; page_idx < CHUNK_PAGES && page_idx % 16; ++page_idx) {
+        if (page_map->page_info[page_idx]) {
+            return page_idx;
+        }
+    }
+    for (; page_idx < CHUNK_PAGES; page_idx += 16) {
+        mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*) &page_map->page_info[page_idx]), _mm_setzero_si128())) & 0xffff;
+        if (mask) {
+            return page_idx + __builtin_ctz(mask);
+        }
+    }
+    return CHUNK_PAGES;
+}
+
 char identify_usage(void *ptr) {
     /* find out if ptr points to a small, large or huge region */
     nvm_block_header_t *nvm_block = NULL;
+    nvm_page_map_t *page_map = NULL;
     uintptr_t rel_ptr = (uintptr_t)ptr - (uintptr_t)nvm_start;
     if (rel_ptr % CHUNK_SIZE == sizeof(nvm_huge_header_t)) {
         /* ptr is 64 bytes into a chunk, must be huge allocation */
         return USAGE_HUGE;
-    } else if (rel_ptr % BLOCK_SIZE > sizeof(nvm_block_header_t)) {
+    }
+    nvm_block = (nvm_block_header_t*) block_header_of(ptr);
+    if ((uintptr_t)ptr - (uintptr_t)nvm_block > sizeof(nvm_block_header_t)) {
         /* ptr is more than 64 bytes into a block, must be a small allocation */
         return USAGE_RUN;
-    } else if (rel_ptr % BLOCK_SIZE == sizeof(nvm_block_header_t)) {
-        /* ptr is exactly 64 bytes into a block, can be either small or large --> now we must check header */
-        nvm_block = (nvm_block_header_t*) ((uintptr_t)ptr - sizeof(nvm_block_header_t));
+    } else if ((uintptr_t)ptr - (uintptr_t)nvm_block == sizeof(nvm_block_header_t)) {
+        /* ptr is exactly 64 bytes into a block, can be either small or large --> a page marked as allocated block
+           settles it without touching the block, otherwise we must check header */
+        page_map = (nvm_page_map_t*) ((uintptr_t)nvm_start + (rel_ptr & ~(CHUNK_SIZE-1)) + BLOCK_SIZE);
+        if (PAGE_USAGE(page_map->page_info[(rel_ptr % CHUNK_SIZE) / BLOCK_SIZE]) == USAGE_BLOCK) {
+            return USAGE_BLOCK;
+        }
         if (GET_USAGE(nvm_block->state) == USAGE_BLOCK || GET_USAGE(nvm_block->state) == USAGE_FREE) {
             return USAGE_BLOCK;
         } else {
@@ -40,51 +81,163 @@ char identify_usage(void *ptr) {
     }
 }
 
-void clflush(const void *ptr) {
-    asm volatile("clflush %0" : "+m" (ptr));
+/* non-temporal kernels for whole, aligned cache lines */
+/* ----------------------------------------------------- */
+
+static void nt_copy_sse2(void *dst, const void *src, uint64_t n_bytes) {
+    __m128i *d = (__m128i*) dst;
+    const __m128i *s = (const __m128i*) src;
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, d += 4, s += 4) {
+        _mm_stream_si128(d,   _mm_loadu_si128(s));
+        _mm_stream_si128(d+1, _mm_loadu_si128(s+1));
+        _mm_stream_si128(d+2, _mm_loadu_si128(s+2));
+        _mm_stream_si128(d+3, _mm_loadu_si128(s+3));
+    }
 }
 
-void clflush_range(const void *ptr, uint64_t len) {
-    uintptr_t start = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1);
-    for (; start < (uintptr_t)ptr + len; start += CACHE_LINE_SIZE) {
-        clflush((void*)start);
+static void nt_set_sse2(void *dst, int c, uint64_t n_bytes) {
+    __m128i *d = (__m128i*) dst;
+    __m128i v = _mm_set1_epi8((char)c);
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, d += 4) {
+        _mm_stream_si128(d,   v);
+        _mm_stream_si128(d+1, v);
+        _mm_stream_si128(d+2, v);
+        _mm_stream_si128(d+3, v);
     }
 }
 
-#ifdef HAS_CLFLUSHOPT
-void clflushopt(const void *ptr) {
-    asm volatile("clflushopt %0" : "+m" (ptr));
+__attribute__((target("avx2")))
+static void nt_copy_avx2(void *dst, const void *src, uint64_t n_bytes) {
+    __m256i *d = (__m256i*) dst;
+    const __m256i *s = (const __m256i*) src;
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, d += 2, s += 2) {
+        _mm256_stream_si256(d,   _mm256_loadu_si256(s));
+        _mm256_stream_si256(d+1, _mm256_loadu_si256(s+1));
+    }
 }
 
-void clflushopt_range(const void *ptr, uint64_t len) {
-    uintptr_t start = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1);
-    for (; start < (uintptr_t)ptr + len; start += CACHE_LINE_SIZE) {
-        clflushopt((void*)start);
+__attribute__((target("avx2")))
+static void nt_set_avx2(void *dst, int c, uint64_t n_bytes) {
+    __m256i *d = (__m256i*) dst;
+    __m256i v = _mm256_set1_epi8((char)c);
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, d += 2) {
+        _mm256_stream_si256(d,   v);
+        _mm256_stream_si256(d+1, v);
     }
 }
-#endif
 
-#ifdef HAS_CLWB
-void clwb(const void *ptr) {
-    asm volatile("clwb %0" : "+m" (ptr));
+__attribute__((target("avx512f")))
+static void nt_copy_avx512(void *dst, const void *src, uint64_t n_bytes) {
+    __m512i *d = (__m512i*) dst;
+    const __m512i *s = (const __m512i*) src;
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, ++d, ++s) {
+        _mm512_stream_si512(d, _mm512_loadu_si512(s));
+    }
 }
 
-void clwb_range(const void *ptr, uint64_t len) {
-    uintptr_t start = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1);
-    for (; start < (uintptr_t)ptr + len; start += CACHE_LINE_SIZE) {
-        clwb((void*)start);
+__attribute__((target("avx512f")))
+static void nt_set_avx512(void *dst, int c, uint64_t n_bytes) {
+    __m512i *d = (__m512i*) dst;
+    __m512i v = _mm512_set1_epi32((c & 0xff) * 0x01010101);
+
+    for (; n_bytes > 0; n_bytes -= CACHE_LINE_SIZE, ++d) {
+        _mm512_stream_si512(d, v);
     }
 }
-#endif
 
-void sfence() {
-#ifndef NOFENCE
-    asm volatile("sfence":::"memory");
+/* SSE2 is part of x86-64 and used until persist_init has run */
+static void (*nt_copy)(void *dst, const void *src, uint64_t n_bytes) = nt_copy_sse2;
+static void (*nt_set)(void *dst, int c, uint64_t n_bytes) = nt_set_sse2;
+
+void persist_init() {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    /* structured extended feature flags, EBX bit 23 is CLFLUSHOPT and bit 24 is CLWB */
+    persist_mode = PERSIST_CLFLUSH;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ebx & (1u << 24)) {
+            persist_mode = PERSIST_CLWB;
+        } else if (ebx & (1u << 23)) {
+            persist_mode = PERSIST_CLFLUSHOPT;
+        }
+    }
+
+    /* widest non-temporal stores the cpu and os support */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        nt_copy = nt_copy_avx512;
+        nt_set = nt_set_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        nt_copy = nt_copy_avx2;
+        nt_set = nt_set_avx2;
+    } else {
+        nt_copy = nt_copy_sse2;
+        nt_set = nt_set_sse2;
+    }
+}
+
+void* persist_memcpy(void *dst, const void *src, uint64_t n_bytes) {
+#ifdef NOFLUSH
+    /* with flushes disabled, bypassing the cache would only make the copy slower */
+    return memcpy(dst, src, n_bytes);
+#else
+    uint64_t head = 0, body = 0;
+
+    if (n_bytes < NT_MIN_BYTES) {
+        memcpy(dst, src, n_bytes);
+        PERSIST_RANGE(dst, n_bytes);
+        return dst;
+    }
+
+    /* partial lines at either end go through the cache, whole lines bypass it */
+    head = -(uintptr_t)dst & (CACHE_LINE_SIZE-1);
+    body = (n_bytes - head) & ~(CACHE_LINE_SIZE-1);
+    if (head) {
+        memcpy(dst, src, head);
+        persist_line(dst);
+    }
+    nt_copy((char*)dst + head, (const char*)src + head, body);
+    if (head + body < n_bytes) {
+        memcpy((char*)dst + head + body, (const char*)src + head + body, n_bytes - head - body);
+        persist_line((char*)dst + head + body);
+    }
+
+    /* a single fence drains the streamed lines together with the flushed ones */
+    persist_fence();
+    return dst;
 #endif
 }
 
-void mfence() {
-#ifndef NOFENCE
-    asm volatile("mfence":::"memory");
+void* persist_memset(void *dst, int c, uint64_t n_bytes) {
+#ifdef NOFLUSH
+    return memset(dst, c, n_bytes);
+#else
+    uint64_t head = 0, body = 0;
+
+    if (n_bytes < NT_MIN_BYTES) {
+        memset(dst, c, n_bytes);
+        PERSIST_RANGE(dst, n_bytes);
+        return dst;
+    }
+
+    head = -(uintptr_t)dst & (CACHE_LINE_SIZE-1);
+    body = (n_bytes - head) & ~(CACHE_LINE_SIZE-1);
+    if (head) {
+        memset(dst, c, head);
+        persist_line(dst);
+    }
+    nt_set((char*)dst + head, c, body);
+    if (head + body < n_bytes) {
+        memset((char*)dst + head + body, c, n_bytes - head - body);
+        persist_line((char*)dst + head + body);
+    }
+    persist_fence();
+    return dst;
 #endif
 }
@@ -7,42 +7,156 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "types.h"
+
 inline uint64_t round_up(uint64_t num, uint64_t multiple);
 inline char identify_usage(void *ptr);
+void* block_header_of(void *ptr);
+uint32_t page_map_next(const nvm_page_map_t *page_map, uint32_t page_idx);
+
+/* flush instructions, the one in use is selected from cpuid by persist_init */
+#define PERSIST_CLFLUSH    0
+#define PERSIST_CLFLUSHOPT 1
+#define PERSIST_CLWB       2
+
+extern int persist_mode;
 
-inline void clflush(const void *ptr);
-inline void clflush_range(const void *ptr, uint64_t len);
+void persist_init();
 
-#ifdef HAS_CLFLUSHOPT
-inline void clflushopt(const void *ptr);
-inline void clflushopt_range(const void *ptr, uint64_t len);
+void* persist_memcpy(void *dst, const void *src, uint64_t n_bytes);
+void* persist_memset(void *dst, int c, uint64_t n_bytes);
+
+#if defined(HAS_CLWB)
+    /* the instruction may also be fixed at compile time, letting the compiler drop the dispatch */
+    #define PERSIST_MODE PERSIST_CLWB
+#elif defined(HAS_CLFLUSHOPT)
+    #define PERSIST_MODE PERSIST_CLFLUSHOPT
+#else
+    #define PERSIST_MODE persist_mode
 #endif
 
-#ifdef HAS_CLWB
-inline void clwb(const void *ptr);
-inline void clwb_range(const void *ptr, uint64_t len);
+static inline void clflush(const void *ptr) {
+    asm volatile("clflush %0" : "+m" (*(volatile char*)ptr));
+}
+
+static inline void clflushopt(const void *ptr) {
+    asm volatile("clflushopt %0" : "+m" (*(volatile char*)ptr));
+}
+
+static inline void clwb(const void *ptr) {
+    asm volatile("clwb %0" : "+m" (*(volatile char*)ptr));
+}
+
+static inline void sfence() {
+#ifndef NOFENCE
+    asm volatile("sfence":::"memory");
 #endif
+}
+
+static inline void mfence() {
+#ifndef NOFENCE
+    asm volatile("mfence":::"memory");
+#endif
+}
+
+/* CLFLUSH is only ordered against other stores by an MFENCE, the weakly ordered CLFLUSHOPT and CLWB need an SFENCE */
+static inline void persist_fence() {
+    if (PERSIST_MODE == PERSIST_CLFLUSH) {
+        mfence();
+    } else {
+        sfence();
+    }
+}
+
+static inline void persist_line(const void *ptr) {
+    if (PERSIST_MODE == PERSIST_CLWB) {
+        /* CLWB is the preferred instruction, not invalidating any cache lines */
+        clwb(ptr);
+    } else if (PERSIST_MODE == PERSIST_CLFLUSHOPT) {
+        /* CLFLUSHOPT is preferred over CLFLUSH as flushes to different lines are not serialized */
+        clflushopt(ptr);
+    } else {
+        clflush(ptr);
+    }
+}
+
+static inline void persist_range(const void *ptr, uint64_t len) {
+    uintptr_t start = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1), end = (uintptr_t)ptr + len;
+    int mode = PERSIST_MODE;
+
+    /* dispatch once per range instead of once per line */
+    if (mode == PERSIST_CLWB) {
+        for (; start < end; start += CACHE_LINE_SIZE) {
+            clwb((void*)start);
+        }
+    } else if (mode == PERSIST_CLFLUSHOPT) {
+        for (; start < end; start += CACHE_LINE_SIZE) {
+            clflushopt((void*)start);
+        }
+    } else {
+        for (; start < end; start += CACHE_LINE_SIZE) {
+            clflush((void*)start);
+        }
+    }
+}
+
+/* stores to the same line reach NVM in program order, only the compiler must not reorder them */
+static inline void compiler_barrier() {
+    asm volatile("":::"memory");
+}
+
+/* a persist domain collects the lines an operation dirties and flushes each of them once per commit,
+   the commit's fence orders everything written before it against everything written after it */
+static inline void persist_domain_init(persist_domain_t *domain) {
+    domain->n_lines = 0;
+}
+
+static inline void persist_domain_add(persist_domain_t *domain, const void *ptr) {
+#ifndef NOFLUSH
+    uintptr_t line = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1);
+    uint32_t i;
+
+    for (i=0; i<domain->n_lines; ++i) {
+        if (domain->lines[i] == line) {
+            return;
+        }
+    }
+    if (domain->n_lines == PERSIST_DOMAIN_LINES) {
+        /* out of space, flushing early is safe as the commit's fence still follows */
+        for (i=0; i<domain->n_lines; ++i) {
+            persist_line((void*)domain->lines[i]);
+        }
+        domain->n_lines = 0;
+    }
+    domain->lines[domain->n_lines++] = line;
+#endif
+}
+
+static inline void persist_domain_add_range(persist_domain_t *domain, const void *ptr, uint64_t len) {
+    uintptr_t start = (uintptr_t)ptr & ~(CACHE_LINE_SIZE-1);
+    for (; start < (uintptr_t)ptr + len; start += CACHE_LINE_SIZE) {
+        persist_domain_add(domain, (void*)start);
+    }
+}
+
+static inline void persist_domain_commit(persist_domain_t *domain) {
+    uint32_t i;
 
-inline void sfence();
-inline void mfence();
+    for (i=0; i<domain->n_lines; ++i) {
+        persist_line((void*)domain->lines[i]);
+    }
+    domain->n_lines = 0;
+    persist_fence();
+}
 
-/* macros for persistency depending on instruction availability */
+/* macros for persistency */
 #ifdef NOFLUSH
     /* Completely disable flushes */
     #define PERSIST(ptr)            do { } while (0)
     #define PERSIST_RANGE(ptr, len) do { } while (0)
-#elif HAS_CLWB
-    /* CLWB is the preferred instruction, not invalidating any cache lines */
-    #define PERSIST(ptr)            do { sfence(); clwb(ptr); sfence(); } while (0)
-    #define PERSIST_RANGE(ptr, len) do { sfence(); clwb_range(ptr, len); sfence(); } while (0)
-#elif HAS_CLFLUSHOPT
-    /* CLFLUSHOPT is preferred over CLFLUSH as only dirty cache lines will be evicted */
-    #define PERSIST(ptr)            do { sfence(); clflushopt(ptr); sfence(); } while (0)
-    #define PERSIST_RANGE(ptr, len) do { sfence(); clflushopt_range(ptr, len); sfence(); } while (0)
 #else
-    /* If neither CLWB nor CLFLUSHOPT are available, default to CLFLUSH */
-    #define PERSIST(ptr)            do { mfence(); clflush(ptr); mfence(); } while (0)
-    #define PERSIST_RANGE(ptr, len) do { mfence(); clflush_range(ptr, len); mfence(); } while (0)
+    #define PERSIST(ptr)            do { persist_fence(); persist_line(ptr); persist_fence(); } while (0)
+    #define PERSIST_RANGE(ptr, len) do { persist_fence(); persist_range(ptr, len); persist_fence(); } while (0)
 #endif
 
 #endif /* UTIL_H_ */
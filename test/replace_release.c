@@ -0,0 +1,94 @@
+/* Copyright (c) 2014 Tim Berning */
+
+/* a replacement rejected by nvm_id_replace must give its pages back right away */
+
+#include "nvm_malloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OBJECT_SIZE  (1024ul * 1024ul) /* served from a large block */
+#define N_REJECTED   256
+
+static uint64_t backing_size(const char *workspace) {
+    char path[256];
+    struct stat stbuf;
+
+    snprintf(path, sizeof(path), "%s/backing", workspace);
+    if (stat(path, &stbuf) != 0) {
+        return 0;
+    }
+    return (uint64_t) stbuf.st_size;
+}
+
+static void remove_workspace(const char *workspace) {
+    const char *files[] = {"backing", "meta", "snapshot"};
+    char path[256];
+    int i;
+
+    for (i=0; i<3; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", workspace, files[i]);
+        unlink(path);
+    }
+    rmdir(workspace);
+}
+
+int main() {
+    char workspace[] = "/tmp/nvm_test_XXXXXX";
+    nvm_id_t handle = NULL;
+    void *object = NULL, *pending = NULL, *reused = NULL;
+    uint64_t size_before, size_after;
+    int i, failed = 0;
+
+    if (mkdtemp(workspace) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    nvm_initialize(workspace, 0);
+
+    object = nvm_reserve_id("large", OBJECT_SIZE);
+    memset(object, 1, OBJECT_SIZE);
+    nvm_persist(object, OBJECT_SIZE);
+    nvm_activate_id("large");
+    handle = nvm_id_open("large");
+
+    /* only one replacement may be pending, every further one is rejected */
+    pending = nvm_id_replace(handle, OBJECT_SIZE);
+    size_before = backing_size(workspace);
+    for (i=0; i<N_REJECTED; ++i) {
+        if (nvm_id_replace(handle, OBJECT_SIZE) != NULL) {
+            fprintf(stderr, "replacement %d was not rejected\n", i);
+            failed = 1;
+            break;
+        }
+    }
+    size_after = backing_size(workspace);
+    if (size_after != size_before) {
+        fprintf(stderr, "heap grew from %lu to %lu bytes over rejected replacements\n", size_before, size_after);
+        failed = 1;
+    }
+
+    /* the block of a rejected replacement is the best fit for the next reservation of its size */
+    reused = nvm_reserve(OBJECT_SIZE);
+    if (reused == NULL || backing_size(workspace) != size_before) {
+        fprintf(stderr, "pages of a rejected replacement were not reused\n");
+        failed = 1;
+    }
+    nvm_free(reused, NULL, NULL, NULL, NULL);
+
+    if (!nvm_id_activate(handle) || nvm_id_get(handle) != pending) {
+        fprintf(stderr, "pending replacement was not activated\n");
+        failed = 1;
+    }
+
+    nvm_teardown();
+    remove_workspace(workspace);
+    if (!failed) {
+        printf("replace_release ok\n");
+    }
+    return failed;
+}